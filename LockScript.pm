@@ -0,0 +1,87 @@
+package LockScript;
+use strict;
+use warnings;
+use Exporter qw(import);
+
+# Reads the input files of ./process (format in script.h) for the Perl tools:
+# expand($file) returns N and the instructions with the Repeat blocks and
+# Pid sections written out, one "<pid> Lock <s>", "<pid> Wait <pid>" or
+# "<pid> Leave" line each, in the order every pid runs them.
+
+our @EXPORT_OK = qw(expand);
+
+sub expand {
+	my $file = shift;
+	open(my $fh, '<', $file) or die "$file: $!\n";
+	my $n = <$fh>;
+	die "$file: bad N\n" unless defined $n && $n =~ /^\s*(\d+)/ && $1 > 0;
+	$n = $1;
+	my (@out, @sect, @cur, @open);
+	my $line_pid;
+	my $fail = sub { die "$file:$.: $_[0]\n" };
+	my $flush = sub {
+		return unless @cur;
+		my @to = defined $line_pid ? ($line_pid) : @sect;
+		$fail->("instruction without a pid") unless @to;
+		for my $pid (@to) {
+			push @out, "$pid $_\n" for @cur;
+		}
+		@cur = ();
+	};
+	while (my $line = <$fh>) {
+		$line =~ s/#.*//;
+		my @tok = $line =~ /([{};]|[^\s{};]+)/g;
+		next unless @tok;
+		if (!@open) {
+			if ($tok[0] eq "Pid") {
+				$fail->("expected: Pid <list>") unless @tok == 2;
+				@sect = pid_list($tok[1], $n) or $fail->("bad pid list");
+				next;
+			}
+			$line_pid = $tok[0] =~ /^\d+$/ ? shift @tok : undef;
+		}
+		while (@tok) {
+			my $t = shift @tok;
+			my $arg = @tok && $tok[0] =~ /^\d+$/ ? $tok[0] : undef;
+			if ($t eq ";") {
+				next;
+			} elsif ($t eq "Lock" || $t eq "Wait") {
+				shift @tok if defined $arg;
+				push @cur, "$t " . ($arg // ($t eq "Lock" ? 1 : 0));
+			} elsif ($t eq "Leave" || $t eq "Join") {
+				push @cur, $t;
+			} elsif ($t eq "Repeat") {
+				$fail->("expected: Repeat <count> { ... }") unless defined $arg && @tok > 1 && $tok[1] eq "{";
+				splice(@tok, 0, 2);
+				push @open, [scalar(@cur), $arg];
+			} elsif ($t eq "}") {
+				$fail->("unmatched }") unless @open;
+				my ($at, $count) = @{pop @open};
+				my @body = splice(@cur, $at);
+				push @cur, (@body) x $count;
+			} elsif (defined $arg) {
+				shift @tok; # unknown instructions are skipped, as by ./process
+			}
+			$flush->() unless @open;
+		}
+	}
+	$fail->("unclosed Repeat block") if @open;
+	close($fh);
+	return ($n, @out);
+}
+
+# "2-5,7" or "*"
+sub pid_list {
+	my ($list, $n) = @_;
+	return (0 .. $n - 1) if $list eq "*";
+	my @pids;
+	for my $range (split /,/, $list) {
+		my ($lo, $hi) = $range =~ /^(\d+)(?:-(\d+))?$/ or return ();
+		$hi //= $lo;
+		return () if $lo > $hi;
+		push @pids, $lo .. $hi;
+	}
+	return @pids;
+}
+
+1;
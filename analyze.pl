@@ -0,0 +1,135 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Long;
+use FindBin;
+use lib $FindBin::Bin;
+use LockScript qw(expand);
+
+# Usage: ./analyze.pl [--per-lock] <testfile> [log.txt]
+# Builds the dependency graph of a test file: the k-th Lock of a pid depends
+# on its (k-1)-th, and on the c-th lock of q when it comes after its c-th
+# "Wait q" (the rule run.pl checks). With one lock and no protocol overhead,
+# the shortest possible run takes the sum of the Lock durations (the lock is
+# never idle, any order that respects the graph will do), provided the graph
+# has no cycle; the longest chain of the graph (critical path) is the part
+# of that order which is forced.
+#
+# With a log, every lock of the run is compared to that ideal: it was ready
+# when its pid had released its previous lock and the locks it waits for
+# were released, and the lock was free at the previous release; the time
+# from the later of the two to the take is overhead (protocol, starting
+# ./critical), as is the time held beyond its duration. Times are counted
+# from the first take, so process startup is left out.
+
+my $per_lock = 0;
+GetOptions("per-lock" => \$per_lock) or die "Usage: $0 [--per-lock] <testfile> [log.txt]\n";
+my $test = shift or die "Usage: $0 [--per-lock] <testfile> [log.txt]\n";
+my $log = shift;
+
+# Locks as "pid:k" (k from 1): duration in ns and dependencies
+my (undef, @instructions) = expand($test);
+my (%dur, %deps, %nlocks, %waited, %pending, @order);
+for my $line (@instructions) {
+	if ($line =~ /^\s*(\d+) Wait (\d+)/) {
+		push @{$pending{$1}}, "$2:" . ++$waited{$1}{$2};
+	} elsif ($line =~ /^\s*(\d+) Lock\s*(\d*)/) {
+		my $k = ++$nlocks{$1};
+		my $id = "$1:$k";
+		$dur{$id} = ($2 eq "" ? 1 : $2) * 1e9;
+		$deps{$id} = [($k > 1 ? ("$1:" . ($k - 1)) : ()), @{delete $pending{$1} // []}];
+		push @order, $id;
+	}
+}
+
+# Waits for a lock the other pid never takes end when it exits: no edge
+for my $id (@order) {
+	$deps{$id} = [grep { exists $dur{$_} } @{$deps{$id}}];
+}
+
+# Longest path (Kahn's topological order)
+my (%indeg, %succ, %finish, %via);
+for my $id (@order) {
+	$indeg{$id} = @{$deps{$id}};
+	push @{$succ{$_}}, $id for @{$deps{$id}};
+}
+my @ready = grep { $indeg{$_} == 0 } @order;
+my $seen = 0;
+while (@ready) {
+	my $id = shift @ready;
+	$seen++;
+	my $start = 0;
+	for my $d (@{$deps{$id}}) {
+		if ($finish{$d} > $start) { $start = $finish{$d}; $via{$id} = $d; }
+	}
+	$finish{$id} = $start + $dur{$id};
+	for my $s (@{$succ{$id} // []}) {
+		push @ready, $s if --$indeg{$s} == 0;
+	}
+}
+if ($seen < @order) {
+	my @stuck = grep { $indeg{$_} > 0 } @order;
+	print "dependency cycle: the run deadlocks (locks never ready: @stuck)\n";
+	exit 1;
+}
+my $ideal = 0;
+$ideal += $dur{$_} for @order;
+my ($last) = sort { $finish{$b} <=> $finish{$a} } @order;
+my @path;
+for (my $id = $last; defined $id; $id = $via{$id}) { unshift @path, $id; }
+
+printf "locks            %d\n", scalar(@order);
+printf "ideal makespan   %.3f s (sum of Lock durations)\n", $ideal / 1e9;
+printf "critical path    %.3f s: %s\n", $last ? $finish{$last} / 1e9 : 0, join(" -> ", @path);
+exit 0 unless defined $log;
+
+# Compare with the run
+open(my $lfh, '<', $log) or die "$log: $!";
+my (%take, %rel, %count, @events);
+my $prev_release;
+while (my $l = <$lfh>) {
+	next unless $l =~ /^\[Process (\d+)\] \[Time (\d+)\] Lock (taken|released)/;
+	if ($3 eq "taken") {
+		my $id = "$1:" . ++$count{$1};
+		$take{$id} = $2;
+		push @events, [$id, $prev_release];
+	} else {
+		$rel{"$1:$count{$1}"} = $2 if $count{$1};
+		$prev_release = $2;
+	}
+}
+close($lfh);
+die "$log: no lock taken\n" unless @events;
+
+my $t0 = $take{$events[0][0]};
+my ($idle, $hold_extra, @over) = (0, 0);
+my $last_release = $t0;
+printf "\n%-8s %10s %10s %10s %12s %12s\n", "lock", "ready ms", "free ms", "taken ms", "overhead ms", "held+ ms"
+	if $per_lock;
+for my $e (@events) {
+	my ($id, $free) = @$e;
+	next unless exists $dur{$id} && exists $rel{$id};
+	my $ready = $t0;
+	for my $d (@{$deps{$id}}) {
+		$ready = $rel{$d} if exists $rel{$d} && $rel{$d} > $ready;
+	}
+	my $from = $ready;
+	$from = $free if defined $free && $free > $from;
+	my $over = $take{$id} - $from;
+	$over = 0 if $over < 0;
+	my $extra = ($rel{$id} - $take{$id}) - $dur{$id};
+	$idle += $over;
+	$hold_extra += $extra;
+	push @over, $over;
+	$last_release = $rel{$id} if $rel{$id} > $last_release;
+	printf "%-8s %10.3f %10.3f %10.3f %12.3f %12.3f\n", $id, ($ready - $t0) / 1e6,
+		defined $free ? ($free - $t0) / 1e6 : 0, ($take{$id} - $t0) / 1e6, $over / 1e6, $extra / 1e6
+		if $per_lock;
+}
+@over = sort { $a <=> $b } @over;
+my $real = $last_release - $t0;
+printf "\nreal makespan    %.3f s from the first take (%.1f%% above ideal)\n", $real / 1e9,
+	$ideal ? ($real - $ideal) * 100 / $ideal : 0;
+printf "hand-over        %.3f s in total: mean %.3f ms, p50 %.3f ms, max %.3f ms per lock\n", $idle / 1e9,
+	@over ? $idle / @over / 1e6 : 0, @over ? $over[int(@over / 2)] / 1e6 : 0, @over ? $over[-1] / 1e6 : 0;
+printf "held too long    %.3f s in total (beyond the Lock durations)\n", $hold_extra / 1e9;
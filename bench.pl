@@ -0,0 +1,212 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Temp qw(tempdir);
+use POSIX qw(WNOHANG);
+use Time::HiRes qw(sleep time);
+
+# Usage: ./bench.pl [--n 2,4,8] [--patterns all,hot,single] [--transports tcp,unix,vnodes,local]
+#                   [--batching off,on] [--leases off,on] [--locks 20] [--cs-us 0] [--rate r | --think-us us]
+#                   [--counters] [--base-port port] [--timeout 60] [--out bench.csv] [--no-plot]
+# Runs `./process --bench` for every combination of the lists and writes one
+# CSV row per run (throughput, grant latency percentiles), plus bench.gp, a
+# gnuplot script plotting them (unless --no-plot); the plots are drawn when
+# gnuplot is installed.
+#
+# Contention patterns: all = every pid takes the lock --locks times,
+# hot = only the first quarter of the pids does, single = only pid 0 does.
+# Transports: tcp = one process per pid over TCP loopback, unix = the same
+# over Unix sockets (--config), vnodes = 4 pids per process over TCP
+# (--vnodes 4), local = every pid in one process (--vnodes N).
+# Batching on = one copy of each broadcast per process, with the replies
+# combined (--relay); only processes hosting several pids can batch, so the
+# other transports run with batching off only.
+# There is a single lock algorithm; the protocol modes are leases off and on.
+# The load is closed-loop unless --rate gives each locking pid Poisson
+# arrivals of r locks per second (./process --rate); latencies then count
+# from the arrivals.
+# With --counters (./process --counters), each row also gets the CPU events
+# per lock: of the grant path (mean over the pids) and of message handling
+# (summed over the processes, i.e. the cost of a lock to the whole mesh);
+# counters the machine does not provide are left empty.
+# --base-port is passed to ./process, so that runs next to other benchmarks
+# or tests (run_all.pl, perfgate.pl) do not compete for the same ports.
+
+my $ns = "2,4,8,16,32,64,128";
+my $patterns = "all,hot,single";
+my $transports = "tcp,unix,vnodes,local";
+my $batching = "off,on";
+my $leases = "off,on";
+my $locks = 20;
+my $cs_us = 0;
+my $timeout = 60;
+my $out = "bench.csv";
+my $no_plot = 0;
+my $rate = 0;
+my $think_us = 0;
+my $counters = 0;
+my $base_port;
+my @events = ("cycles", "instructions", "cache-misses", "context-switches", "task-clock-ns");
+GetOptions("n=s" => \$ns, "patterns=s" => \$patterns, "transports=s" => \$transports, "batching=s" => \$batching,
+           "leases=s" => \$leases, "locks=i" => \$locks, "cs-us=i" => \$cs_us,
+           "rate=f" => \$rate, "think-us=i" => \$think_us, "counters" => \$counters, "base-port=i" => \$base_port,
+           "timeout=i" => \$timeout, "out=s" => \$out, "no-plot" => \$no_plot)
+	or die "Usage: $0 [--n list] [--patterns list] [--transports list] [--batching list] [--leases list] " .
+	       "[--locks k] [--cs-us us] [--rate r | --think-us us] [--counters] [--base-port port] [--timeout s] [--out file] [--no-plot]\n";
+
+my $dir = tempdir("bench.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+
+# Script of a run: N on the first line, then the Lock instructions of the pattern
+sub write_script {
+	my ($n, $pattern) = @_;
+	my $lockers = $pattern eq "all" ? $n : $pattern eq "hot" ? int(($n + 3) / 4) : 1;
+	open(my $fh, '>', "$dir/script") or die "$dir/script: $!";
+	print $fh "$n\nPid 0-" . ($lockers - 1) . "\nRepeat $locks { Lock $cs_us }\n";
+	close($fh);
+	return $lockers * $locks;
+}
+
+# Command lines of the processes of a run
+sub commands {
+	my ($n, $transport, $batch, $lease) = @_;
+	my @common = ("./process", "--bench");
+	push @common, "--relay" if $batch eq "on";
+	push @common, "--lease-ms", "1000" if $lease eq "on";
+	push @common, "--rate", $rate if $rate > 0;
+	push @common, "--think-us", $think_us if $think_us > 0;
+	push @common, "--counters" if $counters;
+	push @common, "--base-port", $base_port if defined $base_port;
+	if ($transport eq "local") {
+		return ([@common, "--vnodes", $n, 0, "$dir/script"]);
+	}
+	if ($transport eq "vnodes") {
+		my $k = $n < 4 ? $n : 4;
+		return map { [@common, "--vnodes", $k, $_ * $k, "$dir/script"] } 0 .. int(($n + $k - 1) / $k) - 1;
+	}
+	if ($transport eq "unix") {
+		open(my $fh, '>', "$dir/config") or die "$dir/config: $!";
+		print $fh "$_ unix:$dir/s$_\n" for 0 .. $n - 1;
+		close($fh);
+		push @common, "--config", "$dir/config";
+	}
+	return map { [@common, $_, "$dir/script"] } 0 .. $n - 1;
+}
+
+# Spawn the processes with their output in $dir/out.<i>; returns 1 if all
+# exited in time (the others are killed)
+sub run_processes {
+	my @cmds = @_;
+	my %alive;
+	for my $i (0 .. $#cmds) {
+		my $pid = fork();
+		die "Fork failed: $!" unless defined $pid;
+		if ($pid == 0) {
+			open(STDOUT, '>', "$dir/out.$i") or die "$dir/out.$i: $!";
+			open(STDERR, '>', "/dev/null");
+			exec(@{$cmds[$i]}) or die "Exec failed: $!";
+		}
+		$alive{$pid} = 1;
+	}
+	my $deadline = time() + $timeout;
+	while (%alive && time() < $deadline) {
+		my $pid = waitpid(-1, WNOHANG);
+		if ($pid > 0) { delete $alive{$pid}; } else { sleep(0.05); }
+	}
+	return 1 unless %alive;
+	kill 'KILL', keys %alive;
+	1 while wait() >= 0;
+	return 0;
+}
+
+sub percentile {
+	my ($sorted, $p) = @_;
+	return 0 unless @$sorted;
+	my $i = int(@$sorted * $p);
+	$i = $#$sorted if $i > $#$sorted;
+	return $sorted->[$i];
+}
+
+open(my $csv, '>', $out) or die "$out: $!";
+my @counter_cols;
+if ($counters) {
+	for my $where ("grant", "loop") {
+		push @counter_cols, map { (my $c = "${where}_$_") =~ tr/-/_/; $c } @events;
+	}
+}
+print $csv join(",", "n,pattern,transport,batching,lease,locks,seconds,locks_per_s,mean_us,p50_us,p90_us,p99_us,max_us,status",
+	@counter_cols), "\n";
+for my $n (split /,/, $ns) {
+	for my $pattern (split /,/, $patterns) {
+		for my $transport (split /,/, $transports) {
+			for my $batch ($transport eq "vnodes" ? split(/,/, $batching) : ("off")) {
+				for my $lease (split /,/, $leases) {
+					my $expected = write_script($n, $pattern);
+					my @cmds = commands($n, $transport, $batch, $lease);
+					unlink glob("$dir/out.*");
+					my $ok = run_processes(@cmds);
+
+					my (@lat, $elapsed, %grant, %loop, $grant_locks);
+					$elapsed = 0;
+					$grant_locks = 0;
+					for my $i (0 .. $#cmds) {
+						open(my $fh, '<', "$dir/out.$i") or next;
+						while (my $l = <$fh>) {
+							if ($l =~ /^\[proc \d+\] counters (grant|loop) (\d+) (.*)$/) {
+								my ($where, $k, $rest) = ($1, $2, $3);
+								my %v = $rest =~ /([\w-]+)=([\d.]+)/g;
+								$grant_locks += $k if $where eq "grant";
+								for my $e (keys %v) {
+									if ($where eq "grant") { $grant{$e} += $v{$e} * $k; } else { $loop{$e} += $v{$e}; }
+								}
+								next;
+							}
+							next unless $l =~ /^\[proc \d+\] bench (\d+) (\d+) ?([\d,]*)$/;
+							$elapsed = $2 if $2 > $elapsed;
+							push @lat, split(/,/, $3) if $1 > 0;
+						}
+						close($fh);
+					}
+					my @counter_vals;
+					if ($counters) {
+						push @counter_vals, map { defined $grant{$_} && $grant_locks ? sprintf("%.1f", $grant{$_} / $grant_locks) : "" }
+							@events;
+						push @counter_vals, map { defined $loop{$_} ? sprintf("%.1f", $loop{$_}) : "" } @events;
+					}
+					my $status = !$ok ? "timeout" : @lat != $expected ? "incomplete" : "ok";
+					@lat = sort { $a <=> $b } @lat;
+					my $sum = 0;
+					$sum += $_ for @lat;
+					my $sec = $elapsed / 1e6;
+					printf $csv "%d,%s,%s,%s,%s,%d,%.6f,%.1f,%.1f,%d,%d,%d,%d,%s%s\n", $n, $pattern, $transport, $batch, $lease,
+						scalar(@lat), $sec, $sec > 0 ? @lat / $sec : 0, @lat ? $sum / @lat : 0,
+						percentile(\@lat, 0.5), percentile(\@lat, 0.9), percentile(\@lat, 0.99),
+						@lat ? $lat[-1] : 0, $status, join("", map { ",$_" } @counter_vals);
+					printf "n=%-4d %-7s %-6s batching=%-3s lease=%-3s %s\n", $n, $pattern, $transport, $batch, $lease, $status;
+				}
+			}
+		}
+	}
+}
+close($csv);
+exit 0 if $no_plot;
+
+# Throughput and p99 latency against N, one line per transport and
+# batching, for each pattern (leases off when that was measured)
+my ($plot_lease) = grep { $_ eq "off" } split(/,/, $leases);
+$plot_lease //= (split /,/, $leases)[0];
+open(my $gp, '>', "bench.gp") or die "bench.gp: $!";
+print $gp "set datafile separator ','\nset terminal png size 900,600\nset logscale x 2\nset xlabel 'N'\nset key left top\n";
+for my $pattern (split /,/, $patterns) {
+	for my $plot (["locks_per_s", 8, "throughput (locks/s)"], ["p99_us", 12, "p99 grant latency (us)"]) {
+		my ($name, $col, $label) = @$plot;
+		print $gp "set output 'bench-$pattern-$name.png'\nset ylabel '$label'\nset title '$pattern, lease $plot_lease'\nplot ";
+		print $gp join(", ", map {
+			my ($transport, $batch) = @$_;
+			my $title = $batch eq "on" ? "$transport batched" : $transport;
+			"'< awk -F, \"\\\$2==\\\"$pattern\\\" && \\\$3==\\\"$transport\\\" && \\\$4==\\\"$batch\\\" && \\\$5==\\\"$plot_lease\\\"\" $out' using 1:$col with linespoints title '$title'"
+		} map { my $t = $_; map { [$t, $_] } $t eq "vnodes" ? split(/,/, $batching) : ("off") } split(/,/, $transports)), "\n";
+	}
+}
+close($gp);
+system("gnuplot bench.gp") if system("command -v gnuplot >/dev/null 2>&1") == 0;
@@ -1,15 +1,27 @@
 /*
 * Usage ./critical <process ID> <sleep duration>
+*       ./critical --serve
+*
+* With --serve, runs one critical section per "<process ID> <sleep duration>
+* [fencing token]" line read on stdin and answers "done" on stdout once it
+* is over, or "error" when the line is malformed or cannot be logged. One
+* line per section rather than separate enter/exit commands keeps the sleep
+* and the taken/released log pair here, as in the one-shot mode.
+*
+* Logs to log.txt, synced after every line; when LOCK_LOG_DIR is set, each
+* process ID logs to <LOCK_LOG_DIR>/log.<process ID>.txt instead, without
+* syncing (merge them with merge_logs.pl).
 *
 * Output:
 * [Process \d+] [Time \d+] Lock taken
 * [Process \d+] [Time \d+] Lock released
 */
+#define _GNU_SOURCE /* asprintf */
 #include<stdio.h>
 #include<stdlib.h>
+#include<string.h>
 #include<unistd.h>
 #include<fcntl.h>
-#include<assert.h>
 #include<time.h>
 
 static unsigned long  current_time(void) {
@@ -18,43 +30,88 @@ static unsigned long  current_time(void) {
 	return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void append(int fd, int pid, int release) {
-	 char *msg;
-	 int written = 0;
-    int len = asprintf(&msg, "[Process %d] [Time %lu] Lock %s\n", pid, current_time(), release ? "released" : "taken");
-    assert(len > 0);
-
-	 while(written < len) {
-		 int ret = write(fd, msg + written, len - written);
-		 if(ret == -1) {
-			 perror("Failed to write to log.txt file");
-			 free(msg);
-			 exit(1);
-		 }
-		 written += ret;
-	 }
-
-	 fsync(fd);
-	 free(msg);
+/* Log one line; -1 if it could not be written. */
+static int append(int fd, int pid, int release) {
+	char *msg;
+	int written = 0;
+	int len = asprintf(&msg, "[Process %d] [Time %lu] Lock %s\n", pid, current_time(), release ? "released" : "taken");
+	if(len < 0) {
+		perror("Failed to format the log line");
+		return -1;
+	}
+
+	while(written < len) {
+		int ret = write(fd, msg + written, len - written);
+		if(ret == -1) {
+			perror("Failed to write to log.txt file");
+			free(msg);
+			return -1;
+		}
+		written += ret;
+	}
+
+	if(!getenv("LOCK_LOG_DIR")) fsync(fd);
+	free(msg);
+	return 0;
+}
+
+static int open_log(int pid) {
+	const char *dir = getenv("LOCK_LOG_DIR");
+	char path[4096];
+	int len = dir ? snprintf(path, sizeof(path), "%s/log.%d.txt", dir, pid) : snprintf(path, sizeof(path), "log.txt");
+	if(len < 0 || len >= (int)sizeof(path)) {
+		fprintf(stderr, "Log file path too long\n");
+		return -1;
+	}
+	int log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (log_fd == -1) perror("Failed to open log file");
+	return log_fd;
+}
+
+#define MAX_LOGS 1024
+
+static int serve(void) {
+	char line[128];
+	int pid, sleep_duration;
+	int log_fds[MAX_LOGS]; /* per process ID with LOCK_LOG_DIR, else all log.txt */
+	for(int i = 0; i < MAX_LOGS; i++) log_fds[i] = -1;
+	while(fgets(line, sizeof(line), stdin)) {
+		if(sscanf(line, "%d %d", &pid, &sleep_duration) != 2 || pid < 0 || pid >= MAX_LOGS) {
+			printf("error\n");
+			fflush(stdout);
+			continue;
+		}
+		int slot = getenv("LOCK_LOG_DIR") ? pid : 0;
+		if(log_fds[slot] == -1 && (log_fds[slot] = open_log(pid)) == -1) return 1;
+		int log_fd = log_fds[slot];
+		/* a section that could not be logged fails: the caller gets "error" */
+		int ok = append(log_fd, pid, 0) == 0;
+		if(ok) {
+			sleep(sleep_duration);
+			ok = append(log_fd, pid, 1) == 0;
+		}
+		printf(ok ? "done\n" : "error\n");
+		fflush(stdout);
+	}
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
+	if(argc == 2 && strcmp(argv[1], "--serve") == 0) return serve();
 	if(argc != 3) {
 		printf("Usage: %s <process ID> <sleep duration>\n", argv[0]);
+		printf("       %s --serve\n", argv[0]);
 		return 1;
 	}
 
 	int pid = atoi(argv[1]);
 	int sleep_duration = atoi(argv[2]);
-	int log_fd = open("log.txt", O_WRONLY | O_CREAT | O_APPEND, 0644);
-	if (log_fd == -1) {
-		perror("Failed to open log.txt file");
-		return 1;
-	}
+	int log_fd = open_log(pid);
+	if (log_fd == -1) return 1;
 
-	append(log_fd, pid, 0);
+	if(append(log_fd, pid, 0) != 0) return 1;
 	sleep(sleep_duration);
-	append(log_fd, pid, 1);
+	if(append(log_fd, pid, 1) != 0) return 1;
 
 	return 0;
 }
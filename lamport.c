@@ -0,0 +1,747 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lamport.h"
+
+_Atomic int N = 0;
+static pthread_mutex_t n_m = PTHREAD_MUTEX_INITIALIZER;
+
+/* The lock order of lamport.h, checked on every acquisition: a thread only
+   takes a lock ranked after every lock it holds (unless NDEBUG). */
+enum { RANK_OUT, RANK_LC, RANK_QUEUE, RANK_FD, RANK_LEASE, RANK_ACK, RANK_REL, RANK_JOIN, RANK_N };
+static __thread unsigned held_ranks;
+
+static void node_lock(pthread_mutex_t *m, int rank) {
+    assert((held_ranks >> rank) == 0 && "lamport.c lock order violated (see lamport.h)");
+    pthread_mutex_lock(m);
+    held_ranks |= 1u << rank;
+}
+static void node_unlock(pthread_mutex_t *m, int rank) {
+    held_ranks &= ~(1u << rank);
+    pthread_mutex_unlock(m);
+}
+
+/* Make room for `pid` in the pid slots [0, N-1]. */
+static void grow_n(int pid) {
+    node_lock(&n_m, RANK_N);
+    if (pid >= N) N = pid + 1;
+    node_unlock(&n_m, RANK_N);
+}
+
+/* Print a protocol event of node `n` unless it is quiet. */
+static void note(Node *n, const char *fmt, ...) {
+    if (n->quiet) return;
+    va_list ap;
+    va_start(ap, fmt);
+    flockfile(stdout);
+    printf("[proc %d] ", n->pid);
+    vprintf(fmt, ap);
+    putchar('\n');
+    fflush(stdout);
+    funlockfile(stdout);
+    va_end(ap);
+}
+
+/* Notify the owner that state a waiter may look at changed. */
+static void changed(Node *n) {
+    if (n->ops->changed) n->ops->changed(n);
+}
+
+void node_init(Node *n, int pid, const NodeOps *ops, void *ctx) {
+    memset(n, 0, sizeof(*n));
+    n->pid = pid;
+    n->ops = ops;
+    n->ctx = ctx;
+    n->cur_req_lc = -1;
+    n->held_req_lc = -1;
+    pthread_mutex_init(&n->lc_m, NULL);
+    pthread_mutex_init(&n->out_m, NULL);
+    pthread_mutex_init(&n->queue_m, NULL);
+    pthread_mutex_init(&n->fd_m, NULL);
+    pthread_mutex_init(&n->lease_m, NULL);
+    pthread_mutex_init(&n->ack_m, NULL);
+    pthread_mutex_init(&n->rel_m, NULL);
+    pthread_mutex_init(&n->join_m, NULL);
+    grow_n(pid);
+}
+
+/* Copy the state of `n` into `s` with all of its locks held at once, so that
+   the parts agree with each other; only copies are made under the locks. */
+void node_snapshot(Node *n, NodeSnapshot *s) {
+    node_lock(&n->lc_m, RANK_LC);
+    node_lock(&n->queue_m, RANK_QUEUE);
+    node_lock(&n->fd_m, RANK_FD);
+    node_lock(&n->lease_m, RANK_LEASE);
+    node_lock(&n->ack_m, RANK_ACK);
+    node_lock(&n->rel_m, RANK_REL);
+    s->pid = n->pid;
+    s->lc = n->lc;
+    s->n = N;
+    s->cur_req_lc = n->cur_req_lc;
+    s->held_req_lc = n->held_req_lc;
+    s->lease_lost = n->lease_lost;
+    s->queue_len = n->queue_len;
+    s->queue = malloc((n->queue_len ? n->queue_len : 1) * sizeof(ReqEntry));
+    memcpy(s->queue, &n->queue[n->queue_start], n->queue_len * sizeof(ReqEntry));
+    memcpy(s->ack_lc, n->ack_lc, sizeof(s->ack_lc));
+    memcpy(s->releases_seen, n->releases_seen, sizeof(s->releases_seen));
+    memcpy(s->peer_state, n->peer_state, sizeof(s->peer_state));
+    node_unlock(&n->rel_m, RANK_REL);
+    node_unlock(&n->ack_m, RANK_ACK);
+    node_unlock(&n->lease_m, RANK_LEASE);
+    node_unlock(&n->fd_m, RANK_FD);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+    node_unlock(&n->lc_m, RANK_LC);
+}
+
+/* Lamport clock (logical clock) and helpers. */
+/* Increment logical clock and return new value. */
+int inc_lc(Node *n) {
+    node_lock(&n->lc_m, RANK_LC);
+    n->lc++;
+    int tmp = n->lc;
+    node_unlock(&n->lc_m, RANK_LC);
+    return tmp;
+}
+/* Update local logical clock after receiving a timestamp. */
+int update_lc_on_receive(Node *n, int remote_lc) {
+    node_lock(&n->lc_m, RANK_LC);
+    if (remote_lc >= n->lc) n->lc = remote_lc + 1;
+    int tmp = n->lc;
+    node_unlock(&n->lc_m, RANK_LC);
+    return tmp;
+}
+
+/* Current value of the clock. */
+int node_clock(Node *n) {
+    node_lock(&n->lc_m, RANK_LC);
+    int tmp = n->lc;
+    node_unlock(&n->lc_m, RANK_LC);
+    return tmp;
+}
+
+/* The queue is an array sorted by (req_lc, req_pid) holding the entries
+   queue[queue_start .. queue_start+queue_len): releasing the head only moves
+   queue_start, and new requests, which usually carry the highest clocks, are
+   inserted near the end. Every function below takes queue_m. */
+static int req_before(int lc_a, int pid_a, int lc_b, int pid_b) {
+    return lc_a < lc_b || (lc_a == lc_b && pid_a < pid_b);
+}
+
+/* Start the lease clock of a new head (caller holds queue_m). */
+static void queue_head_changed(Node *n, int old_lc, int old_pid) {
+    if (n->queue_len == 0) return;
+    ReqEntry *h = &n->queue[n->queue_start];
+    if (h->req_lc != old_lc || h->req_pid != old_pid) h->head_since = n->ops->now_ms();
+}
+/* Identify the current head as (lc, pid), or (-1, -1) if the queue is empty. */
+static void queue_get_head(Node *n, int *lc, int *pid) {
+    *lc = n->queue_len ? n->queue[n->queue_start].req_lc : -1;
+    *pid = n->queue_len ? n->queue[n->queue_start].req_pid : -1;
+}
+/* Remove the entry at absolute index `i`. */
+static void queue_erase(Node *n, int i) {
+    if (i == n->queue_start) {
+        n->queue_start++;
+    } else {
+        int end = n->queue_start + n->queue_len;
+        memmove(&n->queue[i], &n->queue[i + 1], (end - i - 1) * sizeof(ReqEntry));
+    }
+    if (--n->queue_len == 0) n->queue_start = 0;
+}
+
+/* Insert a request into the ordered queue. */
+void queue_insert(Node *n, int req_lc, int req_pid, int lease) {
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int old_lc, old_pid;
+    queue_get_head(n, &old_lc, &old_pid);
+    /* first entry not before the new one */
+    int lo = n->queue_start, hi = n->queue_start + n->queue_len;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (req_before(n->queue[mid].req_lc, n->queue[mid].req_pid, req_lc, req_pid)) lo = mid + 1;
+        else hi = mid;
+    }
+    /* a joiner can learn a request both from a WELCOME snapshot and from the REQ */
+    int end = n->queue_start + n->queue_len;
+    if (lo < end && n->queue[lo].req_lc == req_lc && n->queue[lo].req_pid == req_pid) {
+        node_unlock(&n->queue_m, RANK_QUEUE);
+        return;
+    }
+    if (end == n->queue_cap) {
+        if (n->queue_start > 0) {
+            /* slide the entries back to the front */
+            memmove(n->queue, &n->queue[n->queue_start], n->queue_len * sizeof(ReqEntry));
+            lo -= n->queue_start;
+            n->queue_start = 0;
+        } else {
+            n->queue_cap = n->queue_cap ? n->queue_cap * 2 : 16;
+            n->queue = realloc(n->queue, n->queue_cap * sizeof(ReqEntry));
+        }
+        end = n->queue_start + n->queue_len;
+    }
+    memmove(&n->queue[lo + 1], &n->queue[lo], (end - lo) * sizeof(ReqEntry));
+    ReqEntry *e = &n->queue[lo];
+    e->req_lc = req_lc; e->req_pid = req_pid; e->lease_ms = lease;
+    n->queue_len++;
+    queue_head_changed(n, old_lc, old_pid);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+}
+
+/* Remove a request from the queue (if present). */
+void queue_remove(Node *n, int req_lc, int req_pid) {
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int old_lc, old_pid;
+    queue_get_head(n, &old_lc, &old_pid);
+    int end = n->queue_start + n->queue_len;
+    for (int i = n->queue_start; i < end; ++i) {
+        if (n->queue[i].req_lc == req_lc && n->queue[i].req_pid == req_pid) {
+            queue_erase(n, i);
+            break;
+        }
+    }
+    queue_head_changed(n, old_lc, old_pid);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+}
+
+/* Remove every request issued by `pid` (used when the peer is excluded). */
+void queue_purge_pid(Node *n, int req_pid) {
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int old_lc, old_pid;
+    queue_get_head(n, &old_lc, &old_pid);
+    int end = n->queue_start + n->queue_len, w = n->queue_start;
+    for (int i = n->queue_start; i < end; ++i) {
+        if (n->queue[i].req_pid != req_pid) n->queue[w++] = n->queue[i];
+    }
+    n->queue_len = w - n->queue_start;
+    if (n->queue_len == 0) n->queue_start = 0;
+    queue_head_changed(n, old_lc, old_pid);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+}
+
+/* Remove the head request of another process if it has outlived its lease.
+   Returns 1 and the expired request in *req_lc / *req_pid. */
+static int queue_expire_head(Node *n, int *req_lc, int *req_pid) {
+    long long t = n->ops->now_ms();
+    int expired = 0;
+    node_lock(&n->queue_m, RANK_QUEUE);
+    ReqEntry *e = n->queue_len ? &n->queue[n->queue_start] : NULL;
+    if (e && e->req_pid != n->pid && e->lease_ms > 0 && t - e->head_since > e->lease_ms) {
+        *req_lc = e->req_lc; *req_pid = e->req_pid;
+        queue_erase(n, n->queue_start);
+        queue_head_changed(n, *req_lc, *req_pid);
+        expired = 1;
+    }
+    node_unlock(&n->queue_m, RANK_QUEUE);
+    return expired;
+}
+
+/* Find our own outstanding request; returns its LC (or -1) and lease in *lease.
+   Caller holds queue_m. */
+static int queue_find_own(Node *n, int *lease) {
+    int end = n->queue_start + n->queue_len;
+    for (int i = n->queue_start; i < end; ++i) {
+        if (n->queue[i].req_pid == n->pid) { *lease = n->queue[i].lease_ms; return n->queue[i].req_lc; }
+    }
+    *lease = 0;
+    return -1;
+}
+
+/* Check whether given request is at the head of the queue. */
+int queue_head_is(Node *n, int req_lc, int req_pid) {
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int head_lc, head_pid;
+    queue_get_head(n, &head_lc, &head_pid);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+    return head_lc == req_lc && head_pid == req_pid;
+}
+
+/* Number of queued requests. */
+int queue_depth(Node *n) {
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int len = n->queue_len;
+    node_unlock(&n->queue_m, RANK_QUEUE);
+    return len;
+}
+
+/* Membership. Members take part in the ACK set; a peer leaves the set by
+   announcing LEAVE or by being suspected by the failure detector. Exclusion
+   is sticky (fail-stop): the peer's queued requests are purged and its later
+   messages dropped until it joins again. A suspected peer may only have been
+   slow, so every message still arriving from it is answered with EXCLUDED,
+   and a node told so stops taking part: it never grants itself the lock
+   again, which it could otherwise do with only its own side acknowledging. */
+/* Return true if `pid` is currently a member of the mesh. */
+int is_member(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS) return 0;
+    node_lock(&n->fd_m, RANK_FD);
+    int v = n->peer_state[pid] == PEER_MEMBER;
+    node_unlock(&n->fd_m, RANK_FD);
+    return v;
+}
+/* Admit `pid` as a member (initial membership or JOIN). */
+void add_member(Node *n, int pid) {
+    node_lock(&n->fd_m, RANK_FD);
+    n->peer_state[pid] = PEER_MEMBER;
+    node_unlock(&n->fd_m, RANK_FD);
+    grow_n(pid);
+}
+/* Return true if `pid` left the mesh or is suspected to have failed. */
+int is_excluded(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS) return 0;
+    node_lock(&n->fd_m, RANK_FD);
+    int v = n->peer_state[pid] == PEER_LEFT || n->peer_state[pid] == PEER_SUSPECTED;
+    node_unlock(&n->fd_m, RANK_FD);
+    return v;
+}
+/* Return true if `pid` is suspected to have failed. */
+int is_suspected(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS) return 0;
+    node_lock(&n->fd_m, RANK_FD);
+    int v = n->peer_state[pid] == PEER_SUSPECTED;
+    node_unlock(&n->fd_m, RANK_FD);
+    return v;
+}
+/* Return true if a peer has excluded this node. */
+int node_expelled(Node *n) {
+    node_lock(&n->fd_m, RANK_FD);
+    int v = n->expelled;
+    node_unlock(&n->fd_m, RANK_FD);
+    return v;
+}
+/* Stop taking part after `by` excluded us. */
+static void expel(Node *n, int by) {
+    node_lock(&n->fd_m, RANK_FD);
+    int was = n->expelled;
+    n->expelled = 1;
+    node_unlock(&n->fd_m, RANK_FD);
+    if (was) return;
+    note(n, "excluded by proc %d, no longer taking part", by);
+    if (n->ops->excluded) n->ops->excluded(n, by);
+    changed(n);
+}
+/* Exclude member `pid` (state PEER_LEFT or PEER_SUSPECTED) and drop its pending requests. */
+static int exclude_peer(Node *n, int pid, int state) {
+    node_lock(&n->fd_m, RANK_FD);
+    int was = n->peer_state[pid];
+    if (was == PEER_MEMBER) n->peer_state[pid] = state;
+    node_unlock(&n->fd_m, RANK_FD);
+    if (was != PEER_MEMBER) return 0;
+    queue_purge_pid(n, pid);
+    changed(n);
+    return 1;
+}
+/* Mark `pid` as failed after `silence_ms` without a message from it. */
+void suspect_peer(Node *n, int pid, int silence_ms) {
+    if (!exclude_peer(n, pid, PEER_SUSPECTED)) return;
+    note(n, "suspecting peer %d (no message for %d ms)", pid, silence_ms);
+}
+
+/* Lease of our own outstanding request. */
+/* Start tracking the lease of request `req_lc` (-1 when none is outstanding). */
+static void lease_track(Node *n, int req_lc) {
+    node_lock(&n->lease_m, RANK_LEASE);
+    n->cur_req_lc = req_lc;
+    n->lease_lost = 0;
+    node_unlock(&n->lease_m, RANK_LEASE);
+}
+/* Record that a peer expired our request `req_lc`. */
+static void lease_expired(Node *n, int req_lc) {
+    node_lock(&n->lease_m, RANK_LEASE);
+    if (req_lc == n->cur_req_lc) n->lease_lost = 1;
+    node_unlock(&n->lease_m, RANK_LEASE);
+}
+/* Return true if the lease of the outstanding request was lost. */
+static int lease_is_lost(Node *n) {
+    node_lock(&n->lease_m, RANK_LEASE);
+    int v = n->lease_lost;
+    node_unlock(&n->lease_m, RANK_LEASE);
+    return v;
+}
+/* Fencing token of a grant: increases with the total order (LC, pid) in
+   which grants happen, so a resource can reject a holder whose lease expired. */
+long long fencing_token(int req_lc, int req_pid) {
+    return (long long)req_lc * MAX_PEERS + req_pid;
+}
+
+/* Start a new ACK round for request `req_lc`: only current members must ACK
+   (processes joining later learn the request from the WELCOME snapshot). */
+void reset_acks(Node *n, int req_lc) {
+    node_lock(&n->fd_m, RANK_FD);
+    node_lock(&n->ack_m, RANK_ACK);
+    for (int i = 0; i < MAX_PEERS; ++i) n->ack_lc[i] = n->peer_state[i] == PEER_MEMBER ? -1000000000 : INT_MAX;
+    n->ack_lc[n->pid] = req_lc; /* self-ack */
+    node_unlock(&n->ack_m, RANK_ACK);
+    node_unlock(&n->fd_m, RANK_FD);
+}
+/* Record an ACK from peer `from`. */
+void set_ack(Node *n, int from, int value) {
+    if (from < 0 || from >= MAX_PEERS) return;
+    node_lock(&n->ack_m, RANK_ACK);
+    n->ack_lc[from] = value;
+    node_unlock(&n->ack_m, RANK_ACK);
+}
+/* Return true if all remaining members have ACKed at least `target_lc`. */
+int all_acks_ge(Node *n, int target_lc) {
+    int ok = 1, np = N;
+    node_lock(&n->fd_m, RANK_FD);
+    node_lock(&n->ack_m, RANK_ACK);
+    for (int i = 0; i < np; ++i) {
+        if (n->ack_lc[i] < target_lc && n->peer_state[i] == PEER_MEMBER) { ok = 0; break; }
+    }
+    node_unlock(&n->ack_m, RANK_ACK);
+    node_unlock(&n->fd_m, RANK_FD);
+    return ok;
+}
+
+/* Track releases seen per process for Wait semantics. */
+/* Increment releases_seen counter for `pid`; returns the new count. */
+static int inc_release_seen(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS) return 0;
+    node_lock(&n->rel_m, RANK_REL);
+    int v = ++n->releases_seen[pid];
+    node_unlock(&n->rel_m, RANK_REL);
+    return v;
+}
+/* Raise releases_seen for `pid` to the sender-reported count `count` (idempotent,
+   so a release learnt both from a WELCOME and from the REL is counted once). */
+static void max_release_seen(Node *n, int pid, int count) {
+    if (pid < 0 || pid >= MAX_PEERS) return;
+    node_lock(&n->rel_m, RANK_REL);
+    if (count > n->releases_seen[pid]) n->releases_seen[pid] = count;
+    node_unlock(&n->rel_m, RANK_REL);
+}
+/* Read releases_seen for `pid`. */
+int get_release_seen(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS) return 0;
+    node_lock(&n->rel_m, RANK_REL);
+    int v = n->releases_seen[pid];
+    node_unlock(&n->rel_m, RANK_REL);
+    return v;
+}
+
+/* Send `msg` to `pid` unless it is excluded. */
+static int send_to(Node *n, int pid, const char *msg) {
+    if (pid < 0 || pid >= N || pid == n->pid || is_excluded(n, pid)) return -1;
+    return n->ops->send(n, pid, msg);
+}
+
+/* Broadcast `msg` to all other members. */
+void broadcast_msg(Node *n, const char *msg) {
+    if (!n->ops->multicast) {
+        for (int i = 0; i < N; ++i) {
+            if (i == n->pid || !is_member(n, i)) continue;
+            send_to(n, i, msg);
+        }
+        return;
+    }
+    int dsts[MAX_PEERS], count = 0;
+    for (int i = 0; i < N; ++i) {
+        if (i != n->pid && is_member(n, i)) dsts[count++] = i;
+    }
+    if (count > 0) n->ops->multicast(n, dsts, count, msg);
+}
+
+/* Joining: JOIN is sent to every known member, each answers with a WELCOME
+   carrying its own outstanding request, its release count and its member
+   list; members we did not know about are contacted in turn. A contact may
+   be sent JOIN again (node_join_retry); only its first WELCOME counts. */
+enum { JOIN_SENT = 1, JOIN_DONE = 2, JOIN_LISTED = 4 }; /* join_state flags */
+
+/* Send JOIN to `pid`; without `again`, unless it was already contacted. */
+static void join_send(Node *n, int pid, int again) {
+    node_lock(&n->join_m, RANK_JOIN);
+    int fresh = !(n->join_state[pid] & JOIN_SENT);
+    n->join_state[pid] |= JOIN_SENT;
+    if (fresh) n->join_pending++;
+    node_unlock(&n->join_m, RANK_JOIN);
+    if (!fresh && !again) return;
+    grow_n(pid);
+    char msg[64];
+    node_lock(&n->out_m, RANK_OUT);
+    snprintf(msg, sizeof(msg), "JOIN %d %d\n", inc_lc(n), n->pid);
+    int rc = send_to(n, pid, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    if (rc != 0) {
+        /* nobody listens there (any more): not a member */
+        node_lock(&n->join_m, RANK_JOIN);
+        if (!(n->join_state[pid] & JOIN_DONE)) {
+            n->join_state[pid] |= JOIN_DONE;
+            n->join_pending--;
+        }
+        node_unlock(&n->join_m, RANK_JOIN);
+    }
+}
+static void join_contact(Node *n, int pid) {
+    if (pid < 0 || pid >= MAX_PEERS || pid == n->pid) return;
+    join_send(n, pid, 0);
+}
+
+/* Handle "JOIN <lc> <pid>": admit the joiner and describe our state to it. */
+static void handle_join(Node *n, int join_lc, int pid) {
+    update_lc_on_receive(n, join_lc);
+    /* Snapshot our request and admit the joiner atomically with respect to
+       our own queue_insert/queue_remove: a request inserted after this point
+       is broadcast to the joiner, one removed before it is not reported. */
+    int lease;
+    node_lock(&n->queue_m, RANK_QUEUE);
+    int own_lc = queue_find_own(n, &lease);
+    add_member(n, pid);
+    node_unlock(&n->queue_m, RANK_QUEUE);
+    int rel = get_release_seen(n, n->pid);
+
+    char msg[MAXLINE];
+    node_lock(&n->out_m, RANK_OUT);
+    int off = snprintf(msg, sizeof(msg), "WELCOME %d %d %d %d %d", inc_lc(n), n->pid, own_lc, lease, rel);
+    for (int i = 0; i < N && off < (int)sizeof(msg) - 16; ++i) {
+        if (is_member(n, i)) off += snprintf(msg + off, sizeof(msg) - off, " %d", i);
+    }
+    snprintf(msg + off, sizeof(msg) - off, "\n");
+    send_to(n, pid, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    note(n, "proc %d joined", pid);
+}
+
+/* Handle "WELCOME <lc> <from> <req_lc> <lease> <releases> <member>...". */
+static void handle_welcome(Node *n, const char *line) {
+    int wl, from, req_lc, lease, rel, off = 0;
+    if (sscanf(line, "WELCOME %d %d %d %d %d%n", &wl, &from, &req_lc, &lease, &rel, &off) < 5) return;
+    update_lc_on_receive(n, wl);
+    if (from < 0 || from >= MAX_PEERS) return;
+    node_lock(&n->join_m, RANK_JOIN);
+    int expected = (n->join_state[from] & (JOIN_SENT | JOIN_DONE)) == JOIN_SENT;
+    if (expected) {
+        n->join_state[from] |= JOIN_DONE;
+        n->join_welcomes++;
+    }
+    node_unlock(&n->join_m, RANK_JOIN);
+    if (!expected) return;
+    add_member(n, from);
+    if (req_lc >= 0) queue_insert(n, req_lc, from, lease);
+    max_release_seen(n, from, rel);
+    const char *p = line + off;
+    char *end;
+    for (long m = strtol(p, &end, 10); end != p; p = end, m = strtol(p, &end, 10)) {
+        if (m < 0 || m >= MAX_PEERS) continue;
+        node_lock(&n->join_m, RANK_JOIN);
+        n->join_state[m] |= JOIN_LISTED;
+        node_unlock(&n->join_m, RANK_JOIN);
+        join_contact(n, (int)m);
+    }
+    node_lock(&n->join_m, RANK_JOIN);
+    n->join_pending--;
+    node_unlock(&n->join_m, RANK_JOIN);
+}
+
+/* Join a running mesh, using pids [0, n_initial-1] as the first contacts. */
+void node_join_start(Node *n, int n_initial) {
+    add_member(n, n->pid);
+    for (int i = 0; i < n_initial; ++i) join_contact(n, i);
+}
+
+/* Number of contacted members whose WELCOME is still missing. */
+int node_join_pending(Node *n) {
+    node_lock(&n->join_m, RANK_JOIN);
+    int v = n->join_pending;
+    node_unlock(&n->join_m, RANK_JOIN);
+    return v;
+}
+
+void node_join_retry(Node *n) {
+    int again[MAX_PEERS], count = 0;
+    node_lock(&n->join_m, RANK_JOIN);
+    for (int i = 0; i < MAX_PEERS; ++i) {
+        if ((n->join_state[i] & (JOIN_SENT | JOIN_DONE)) != JOIN_SENT) continue;
+        if (n->join_welcomes > 0 && !(n->join_state[i] & JOIN_LISTED)) {
+            /* an initial contact the members do not know: gone before we came */
+            n->join_state[i] |= JOIN_DONE;
+            n->join_pending--;
+        } else {
+            again[count++] = i;
+        }
+    }
+    node_unlock(&n->join_m, RANK_JOIN);
+    for (int k = 0; k < count; ++k) join_send(n, again[k], 1);
+}
+
+int node_join_missing(Node *n, int *pids) {
+    int count = 0;
+    node_lock(&n->join_m, RANK_JOIN);
+    for (int i = 0; i < MAX_PEERS; ++i) {
+        if ((n->join_state[i] & (JOIN_SENT | JOIN_DONE)) == JOIN_SENT) pids[count++] = i;
+    }
+    node_unlock(&n->join_m, RANK_JOIN);
+    return count;
+}
+
+/* Leave the mesh: peers drop us from the ACK set and stop waiting for us. */
+void node_leave(Node *n) {
+    char msg[64];
+    node_lock(&n->out_m, RANK_OUT);
+    snprintf(msg, sizeof(msg), "LEAVE %d %d\n", inc_lc(n), n->pid);
+    broadcast_msg(n, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    note(n, "left the mesh");
+}
+
+/* Parse and handle a single incoming textual message line. */
+void process_line(Node *n, const char *line) {
+    char type[16];
+    int a,b,c,d;
+    int cnt = sscanf(line, "%15s %d %d %d %d", type, &a, &b, &c, &d);
+    if (cnt < 1 || node_expelled(n)) return;
+    if (strcmp(type, "EXCLUDED") == 0) {
+        /* "EXCLUDED <lc> <from_pid>": obeyed even from a peer we suspect
+           ourselves, and never answered */
+        if (cnt >= 3) expel(n, b);
+        return;
+    }
+    if (strcmp(type, "JOIN") == 0) {
+        if (cnt >= 3 && b >= 0 && b < MAX_PEERS && b != n->pid) handle_join(n, a, b);
+        changed(n);
+        return;
+    }
+    /* every message names its sender: REQ/ACK/EXP/LEAVE/WELCOME second,
+       REL/CANCEL third */
+    int sender = -1;
+    if ((strcmp(type, "REQ") == 0 || strcmp(type, "ACK") == 0 || strcmp(type, "EXP") == 0 ||
+         strcmp(type, "LEAVE") == 0 || strcmp(type, "WELCOME") == 0) && cnt >= 3) sender = b;
+    else if ((strcmp(type, "REL") == 0 || strcmp(type, "CANCEL") == 0) && cnt >= 4) sender = c;
+    if (sender >= 0) {
+        if (is_suspected(n, sender)) {
+            char buf[64];
+            node_lock(&n->out_m, RANK_OUT);
+            snprintf(buf, sizeof(buf), "EXCLUDED %d %d\n", inc_lc(n), n->pid);
+            n->ops->send(n, sender, buf);
+            node_unlock(&n->out_m, RANK_OUT);
+            return;
+        }
+        if (is_excluded(n, sender)) return;
+        if (n->ops->heard) n->ops->heard(n, sender);
+    }
+    if (strcmp(type, "WELCOME") == 0) {
+        handle_welcome(n, line);
+    } else if (strcmp(type, "LEAVE") == 0) {
+        update_lc_on_receive(n, a);
+        if (exclude_peer(n, b, PEER_LEFT)) note(n, "proc %d left", b);
+    } else if (strcmp(type, "REQ") == 0) {
+        int req_lc = a;
+        int req_pid = b;
+        int lease = (cnt >= 4) ? c : 0; /* "REQ <req_lc> <req_pid> [lease_ms]" */
+        update_lc_on_receive(n, req_lc);
+        queue_insert(n, req_lc, req_pid, lease);
+        /* send ACK: "ACK <ack_lc> <from_pid> <for_req_lc> <for_req_pid>\n" */
+        char buf[MAXLINE];
+        node_lock(&n->out_m, RANK_OUT);
+        int mylc = inc_lc(n);
+        snprintf(buf, sizeof(buf), "ACK %d %d %d %d\n", mylc, n->pid, req_lc, req_pid);
+        send_to(n, req_pid, buf);
+        node_unlock(&n->out_m, RANK_OUT);
+    } else if (strcmp(type, "ACK") == 0) {
+        int ack_l = a, from = b, for_req_pid = d;
+        (void)c; /* for_req_lc */
+        update_lc_on_receive(n, ack_l);
+        /* If ACK is for our current request, record it */
+        if (for_req_pid == n->pid) set_ack(n, from, ack_l);
+    } else if (strcmp(type, "REL") == 0) {
+        /* "REL <rel_lc> <req_lc> <req_pid> <releases_of_req_pid>" */
+        int rel_lc = a, req_lc = b, req_pid = c;
+        update_lc_on_receive(n, rel_lc);
+        queue_remove(n, req_lc, req_pid);
+        if (cnt >= 5) max_release_seen(n, req_pid, d);
+        else inc_release_seen(n, req_pid);
+    } else if (strcmp(type, "CANCEL") == 0) {
+        /* request withdrawn before it was granted: not a release */
+        int cancel_lc = a, req_lc = b, req_pid = c;
+        update_lc_on_receive(n, cancel_lc);
+        queue_remove(n, req_lc, req_pid);
+    } else if (strcmp(type, "EXP") == 0) {
+        int exp_lc = a, req_lc = c, req_pid = d;
+        update_lc_on_receive(n, exp_lc);
+        if (req_pid == n->pid) lease_expired(n, req_lc);
+    }
+    changed(n);
+}
+
+/* Issue a REQ for the lock with a lease of `lease` ms (0 = none); returns its LC. */
+int node_request(Node *n, int lease) {
+    char msg[MAXLINE];
+    node_lock(&n->out_m, RANK_OUT);
+    int my_req_lc = inc_lc(n);
+    lease_track(n, my_req_lc);
+    reset_acks(n, my_req_lc);
+    queue_insert(n, my_req_lc, n->pid, lease);
+    n->held_lease = lease;
+    snprintf(msg, sizeof(msg), "REQ %d %d %d\n", my_req_lc, n->pid, lease);
+    broadcast_msg(n, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    return my_req_lc;
+}
+
+/* 1 if the outstanding request is at the head with all ACKs, -1 if a peer
+   expired it, 0 otherwise. */
+int node_grant_state(Node *n) {
+    if (node_expelled(n)) return 0;
+    node_lock(&n->lease_m, RANK_LEASE);
+    int req_lc = n->cur_req_lc, lost = n->lease_lost;
+    node_unlock(&n->lease_m, RANK_LEASE);
+    if (lost) return -1;
+    if (!queue_head_is(n, req_lc, n->pid)) return 0;
+    return all_acks_ge(n, req_lc) ? 1 : 0;
+}
+
+/* Withdraw the outstanding request after it expired before being granted. */
+void node_cancel(Node *n) {
+    char msg[MAXLINE];
+    int req_lc = n->cur_req_lc;
+    queue_remove(n, req_lc, n->pid);
+    node_lock(&n->out_m, RANK_OUT);
+    snprintf(msg, sizeof(msg), "CANCEL %d %d %d\n", inc_lc(n), req_lc, n->pid);
+    broadcast_msg(n, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    lease_track(n, -1);
+}
+
+/* The outstanding request was granted: start its lease, return the fencing token. */
+long long node_enter(Node *n) {
+    n->held_req_lc = n->cur_req_lc;
+    n->held_deadline = n->ops->now_ms() + n->held_lease;
+    return fencing_token(n->held_req_lc, n->pid);
+}
+
+/* Release the lock. Returns 0, or -1 if the lease expired before the release. */
+int node_release(Node *n) {
+    int lost = n->held_lease > 0 && (lease_is_lost(n) || n->ops->now_ms() > n->held_deadline);
+    queue_remove(n, n->held_req_lc, n->pid);
+    int rel_count = inc_release_seen(n, n->pid);
+    char msg[MAXLINE];
+    node_lock(&n->out_m, RANK_OUT);
+    int rel_l = inc_lc(n);
+    snprintf(msg, sizeof(msg), "REL %d %d %d %d\n", rel_l, n->held_req_lc, n->pid, rel_count);
+    broadcast_msg(n, msg);
+    node_unlock(&n->out_m, RANK_OUT);
+    lease_track(n, -1);
+    n->held_req_lc = -1;
+    return lost ? -1 : 0;
+}
+
+int node_expire_leases(Node *n) {
+    int req_lc, req_pid, count = 0;
+    char msg[MAXLINE];
+    while (queue_expire_head(n, &req_lc, &req_pid)) {
+        note(n, "lease of proc %d expired (token %lld)", req_pid, fencing_token(req_lc, req_pid));
+        /* tell the holder: "EXP <lc> <from_pid> <req_lc> <req_pid>" */
+        node_lock(&n->out_m, RANK_OUT);
+        snprintf(msg, sizeof(msg), "EXP %d %d %d %d\n", inc_lc(n), n->pid, req_lc, req_pid);
+        send_to(n, req_pid, msg);
+        node_unlock(&n->out_m, RANK_OUT);
+        count++;
+    }
+    if (count) changed(n);
+    return count;
+}
@@ -0,0 +1,186 @@
+/*
+* Lamport mutual exclusion: state machine of one participant (node).
+*
+* A node owns its Lamport clock, its request queue, the ACKs of its current
+* request, the releases it has seen and its view of the membership. It never
+* blocks and never touches sockets: messages leave through NodeOps.send and
+* come in through process_line, so the same code drives ./process (threads and
+* TCP) and the simulator (one thread, virtual time).
+*
+* Every helper takes the mutex of the state it touches, so a node may be used
+* concurrently by a receiver thread and the thread running its instructions.
+* A thread holding some of them only takes one that comes later in this order:
+*
+*   out_m < lc_m < queue_m < fd_m < lease_m < ack_m < rel_m < join_m < N's lock
+*
+* (for instance out_m is held while ticking the clock and queueing our own
+* request, queue_m while admitting a joiner, fd_m while reading the ACKs
+* against the membership, and node_snapshot takes lc_m..rel_m in a row).
+* lamport.c asserts the order on every acquisition. The NodeOps hooks are
+* called with out_m (send, multicast) or queue_m (now_ms) held, so they must
+* not call back into the node.
+*/
+#ifndef LAMPORT_H
+#define LAMPORT_H
+
+#include <pthread.h>
+
+#define MAXLINE 8192
+#define MAX_PEERS 1024
+
+/* pid slots in use: [0, N-1]; grows (under its own lock) when processes join,
+   while other threads read it */
+extern _Atomic int N;
+
+/* Request queue ordered by (req_lc, req_pid) */
+typedef struct ReqEntry {
+    int req_lc;
+    int req_pid;
+    int lease_ms;         /* lease requested by the holder, 0 = none */
+    long long head_since; /* monotonic ms at which the entry reached the head */
+} ReqEntry;
+
+/* Membership state of a peer as seen by a node. */
+enum { PEER_ABSENT, PEER_MEMBER, PEER_LEFT, PEER_SUSPECTED };
+
+struct Node;
+
+/* Hooks through which a node reaches the outside world. */
+typedef struct NodeOps {
+    /* deliver `msg` to process `dst`; 0 on success, -1 if it cannot be reached */
+    int (*send)(struct Node *n, int dst, const char *msg);
+    /* deliver `msg` to the `count` processes in `dsts` (a broadcast); may be
+       NULL, then each one gets its own send */
+    void (*multicast)(struct Node *n, const int *dsts, int count, const char *msg);
+    /* a message from `pid` was received (failure detector); may be NULL */
+    void (*heard)(struct Node *n, int pid);
+    /* the queue, ACKs, releases, membership or lease may have changed; may be NULL */
+    void (*changed)(struct Node *n);
+    /* monotonic time in milliseconds */
+    long long (*now_ms)(void);
+    /* member `by` has excluded this node, which has stopped taking part
+       (see node_expelled); may be NULL */
+    void (*excluded)(struct Node *n, int by);
+} NodeOps;
+
+typedef struct Node {
+    int pid;
+    const NodeOps *ops;
+    void *ctx;   /* owner data */
+    int quiet;   /* do not print protocol events */
+
+    /* Lamport clock (logical clock) */
+    int lc;
+    pthread_mutex_t lc_m;
+    /* Serializes "tick the clock, then send": messages enter every link in
+       the order of their timestamps, which the grant rule relies on. */
+    pthread_mutex_t out_m;
+
+    /* Request queue ordered by (req_lc, req_pid): queue[queue_start ..
+       queue_start+queue_len), see lamport.c. */
+    ReqEntry *queue;
+    int queue_start, queue_len, queue_cap;
+    pthread_mutex_t queue_m;
+
+    /* Membership (PEER_*) */
+    int peer_state[MAX_PEERS];
+    int expelled;   /* a peer excluded us: no more grants, messages ignored */
+    pthread_mutex_t fd_m;
+
+    /* Outstanding request: peers send EXP when they expire its lease. */
+    int cur_req_lc;
+    int lease_lost;
+    pthread_mutex_t lease_m;
+    /* Request held between node_enter and node_release. */
+    int held_req_lc;
+    int held_lease;
+    long long held_deadline;
+
+    /* ACKs for the current request: last ack logical clock per peer. */
+    int ack_lc[MAX_PEERS];
+    pthread_mutex_t ack_m;
+
+    /* Releases seen per process, for Wait semantics and termination. */
+    int releases_seen[MAX_PEERS];
+    pthread_mutex_t rel_m;
+
+    /* Join handshake: JOIN_* flags per pid, JOINs not answered yet, and
+       WELCOMEs received. */
+    int join_state[MAX_PEERS];
+    int join_pending;
+    int join_welcomes;
+    pthread_mutex_t join_m;
+} Node;
+
+/* Consistent copy of the state of a node, for inspection. */
+typedef struct NodeSnapshot {
+    int pid;
+    int lc;
+    int n;                /* pid slots [0, n-1] */
+    int cur_req_lc;       /* outstanding request, -1 = none */
+    int held_req_lc;      /* request holding the lock, -1 = none */
+    int lease_lost;
+    ReqEntry *queue;      /* malloc'ed copy, in order; free() it */
+    int queue_len;
+    int ack_lc[MAX_PEERS];
+    int releases_seen[MAX_PEERS];
+    int peer_state[MAX_PEERS];
+} NodeSnapshot;
+
+void node_init(Node *n, int pid, const NodeOps *ops, void *ctx);
+void node_snapshot(Node *n, NodeSnapshot *s);
+
+int inc_lc(Node *n);
+int update_lc_on_receive(Node *n, int remote_lc);
+int node_clock(Node *n);
+
+void queue_insert(Node *n, int req_lc, int req_pid, int lease);
+void queue_remove(Node *n, int req_lc, int req_pid);
+void queue_purge_pid(Node *n, int req_pid);
+int queue_head_is(Node *n, int req_lc, int req_pid);
+int queue_depth(Node *n);
+
+int is_member(Node *n, int pid);
+int is_excluded(Node *n, int pid);
+int is_suspected(Node *n, int pid);
+int node_expelled(Node *n);
+void add_member(Node *n, int pid);
+void suspect_peer(Node *n, int pid, int silence_ms);
+
+void reset_acks(Node *n, int req_lc);
+void set_ack(Node *n, int from, int value);
+int all_acks_ge(Node *n, int target_lc);
+
+int get_release_seen(Node *n, int pid);
+
+long long fencing_token(int req_lc, int req_pid);
+
+void broadcast_msg(Node *n, const char *msg);
+void process_line(Node *n, const char *line);
+
+/* Lock protocol: node_request issues a REQ; node_grant_state then reports 1
+   once it may enter, -1 if a peer expired it first (node_cancel withdraws it
+   so that a new one can be issued). node_enter returns the fencing token and
+   node_release returns -1 if the lease ran out while holding the lock. */
+int node_request(Node *n, int lease);
+int node_grant_state(Node *n);
+void node_cancel(Node *n);
+long long node_enter(Node *n);
+int node_release(Node *n);
+
+/* Expire the head request of another process whose lease ran out and tell
+   its holder; returns the number of expired requests. */
+int node_expire_leases(Node *n);
+
+/* Membership changes: node_join_start contacts pids [0, n_initial-1] and
+   node_join_pending counts the WELCOMEs still missing. node_join_retry sends
+   JOIN again to the contacts that did not answer, after dropping those that
+   no WELCOME lists as members; node_join_missing lists the contacts still
+   waited for into `pids` and returns their number. */
+void node_join_start(Node *n, int n_initial);
+int node_join_pending(Node *n);
+void node_join_retry(Node *n);
+int node_join_missing(Node *n, int *pids);
+void node_leave(Node *n);
+
+#endif
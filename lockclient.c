@@ -0,0 +1,101 @@
+/*
+* Usage ./lockclient <socket> run [-l <hold ms>] <command> [args...]
+*       ./lockclient <socket> wait <process ID>
+*
+* Talks to `./process --daemon <socket>`: `run` takes the distributed lock,
+* runs the command with LOCK_FENCING_TOKEN in its environment and releases
+* the lock; `wait` returns once the given process released the lock again.
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/wait.h>
+
+#include "lockd.h"
+
+static int call(int s, int op, int arg, long long *token) {
+	unsigned char req[LOCKD_REQ_SIZE], resp[LOCKD_RESP_SIZE];
+	size_t got = 0;
+	int status;
+
+	lockd_encode_req(req, op, arg);
+	if(write(s, req, sizeof(req)) != sizeof(req)) {
+		perror("write");
+		exit(1);
+	}
+	while(got < sizeof(resp)) {
+		ssize_t r = read(s, resp + got, sizeof(resp) - got);
+		if(r <= 0) {
+			fprintf(stderr, "daemon closed the connection\n");
+			exit(1);
+		}
+		got += r;
+	}
+	lockd_decode_resp(resp, &status, token);
+	return status;
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s <socket> run [-l <hold ms>] <command> [args...]\n", prog);
+	printf("       %s <socket> wait <process ID>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 4) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s == -1 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("Failed to connect to the lock daemon");
+		return 1;
+	}
+
+	long long token;
+	if(strcmp(argv[2], "wait") == 0) {
+		return call(s, LOCKD_OP_WAIT, atoi(argv[3]), &token) == LOCKD_OK ? 0 : 1;
+	}
+	if(strcmp(argv[2], "run") != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int first = 3, hold_ms = 0;
+	if(strcmp(argv[3], "-l") == 0 && argc > 5) {
+		hold_ms = atoi(argv[4]);
+		first = 5;
+	}
+	if(call(s, LOCKD_OP_LOCK, hold_ms, &token) != LOCKD_OK) {
+		fprintf(stderr, "lock refused\n");
+		return 1;
+	}
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%lld", token);
+	setenv("LOCK_FENCING_TOKEN", buf, 1);
+	int rc = 1;
+	pid_t child = fork();
+	if(child == 0) {
+		execvp(argv[first], argv + first);
+		perror("exec");
+		_exit(127);
+	} else if(child > 0) {
+		int st;
+		waitpid(child, &st, 0);
+		rc = WIFEXITED(st) ? WEXITSTATUS(st) : 1;
+	}
+
+	if(call(s, LOCKD_OP_UNLOCK, 0, &token) == LOCKD_LOST) {
+		fprintf(stderr, "lease expired while holding the lock\n");
+		rc = rc ? rc : 1;
+	}
+	return rc;
+}
@@ -0,0 +1,64 @@
+/*
+* Client protocol of `./process --daemon <path>` (Unix stream socket).
+*
+* Every request is 8 bytes and is answered by a 12-byte response, all integers
+* in network byte order:
+*   request:  [op u8] [0 u8 x3] [arg i32]
+*   response: [status u8] [0 u8 x3] [token i64]
+*
+* LOCK   arg = expected hold time in ms (lease hint), token = fencing token
+* UNLOCK arg unused, status LOST if the lease expired before the release
+* WAIT   arg = pid, returns once that process released the lock again
+*
+* A lock still held when the client disconnects is released by the daemon.
+*/
+#ifndef LOCKD_H
+#define LOCKD_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOCKD_REQ_SIZE 8
+#define LOCKD_RESP_SIZE 12
+
+#define LOCKD_OP_LOCK 1
+#define LOCKD_OP_UNLOCK 2
+#define LOCKD_OP_WAIT 3
+
+#define LOCKD_OK 0
+#define LOCKD_LOST 1
+#define LOCKD_EINVAL 2
+
+static inline void lockd_encode_req(unsigned char *buf, int op, int arg) {
+	uint32_t a = htonl((uint32_t)arg);
+	memset(buf, 0, LOCKD_REQ_SIZE);
+	buf[0] = (unsigned char)op;
+	memcpy(buf + 4, &a, 4);
+}
+
+static inline void lockd_decode_req(const unsigned char *buf, int *op, int *arg) {
+	uint32_t a;
+	memcpy(&a, buf + 4, 4);
+	*op = buf[0];
+	*arg = (int)ntohl(a);
+}
+
+static inline void lockd_encode_resp(unsigned char *buf, int status, long long token) {
+	uint32_t hi = htonl((uint32_t)((unsigned long long)token >> 32));
+	uint32_t lo = htonl((uint32_t)token);
+	memset(buf, 0, LOCKD_RESP_SIZE);
+	buf[0] = (unsigned char)status;
+	memcpy(buf + 4, &hi, 4);
+	memcpy(buf + 8, &lo, 4);
+}
+
+static inline void lockd_decode_resp(const unsigned char *buf, int *status, long long *token) {
+	uint32_t hi, lo;
+	memcpy(&hi, buf + 4, 4);
+	memcpy(&lo, buf + 8, 4);
+	*status = buf[0];
+	*token = (long long)(((unsigned long long)ntohl(hi) << 32) | ntohl(lo));
+}
+
+#endif
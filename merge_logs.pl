@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Long;
+
+# Usage: ./merge_logs.pl [-o log.txt] <dir | log files...>
+# Merges the per-pid logs written by ./critical with LOCK_LOG_DIR (or
+# ./process --log-dir) into one log in time order, in the format of log.txt.
+# Each file is already in time order, so this is a k-way merge on a heap.
+# On equal timestamps a release comes before a take, then lower pids first:
+# the lock may pass from one pid to the next within one clock tick, and the
+# checks of run.pl must not see two holders then.
+
+my $out = "-";
+GetOptions("o=s" => \$out) or die "Usage: $0 [-o file] <dir | files...>\n";
+my @files = map { -d $_ ? sort glob("$_/log.*.txt") : $_ } @ARGV;
+die "Usage: $0 [-o file] <dir | files...>\n" unless @ARGV;
+
+# Heap entries: [time, order (0 = released, 1 = taken), pid, line, file handle, file name]
+my @heap;
+sub less {
+	my ($x, $y) = @_;
+	return $x->[0] <=> $y->[0] || $x->[1] <=> $y->[1] || $x->[2] <=> $y->[2];
+}
+sub push_heap {
+	my $e = shift;
+	push @heap, $e;
+	my $i = $#heap;
+	while ($i > 0) {
+		my $p = int(($i - 1) / 2);
+		last if less($heap[$p], $heap[$i]) <= 0;
+		@heap[$p, $i] = @heap[$i, $p];
+		$i = $p;
+	}
+}
+sub pop_heap {
+	my $top = $heap[0];
+	my $last = pop @heap;
+	if (@heap) {
+		$heap[0] = $last;
+		my $i = 0;
+		while (1) {
+			my $c = 2 * $i + 1;
+			last if $c > $#heap;
+			$c++ if $c + 1 <= $#heap && less($heap[$c + 1], $heap[$c]) < 0;
+			last if less($heap[$i], $heap[$c]) <= 0;
+			@heap[$c, $i] = @heap[$i, $c];
+			$i = $c;
+		}
+	}
+	return $top;
+}
+
+# Next entry of `$fh`, or undef at its end
+sub next_entry {
+	my ($fh, $name) = @_;
+	my $l = <$fh>;
+	return undef unless defined $l;
+	$l =~ /^\[Process (\d+)\] \[Time (\d+)\] Lock (taken|released)$/ or die "$name: unrecognized log line: $l";
+	return [$2, $3 eq "released" ? 0 : 1, $1, $l, $fh, $name];
+}
+
+for my $file (@files) {
+	open(my $fh, '<', $file) or die "$file: $!";
+	my $e = next_entry($fh, $file);
+	push_heap($e) if $e;
+}
+open(my $ofh, $out eq "-" ? ">&STDOUT" : ">$out") or die "$out: $!";
+while (@heap) {
+	my $e = pop_heap();
+	print $ofh $e->[3];
+	my $n = next_entry($e->[4], $e->[5]);
+	push_heap($n) if $n;
+}
+close($ofh);
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "lamport.h"
+
+/* Microbenchmarks of the protocol primitives of lamport.c, away from the
+   network: each one calls a primitive in a loop on a node prepared with a
+   realistic state (queue depth, number of pids, threads calling at once) and
+   reports ns/op and cycles/op. Cycles are TSC ticks, so they only match core
+   cycles at the nominal frequency; for real hardware counters run one
+   benchmark alone under perf stat (--only <name>). */
+
+static long long iters = 1000000;
+static const char *only = NULL;
+
+static volatile long long sink; /* keeps results alive */
+
+static long long mb_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static int mb_send(Node *n, int dst, const char *msg) {
+    (void)n; (void)dst; (void)msg;
+    return 0;
+}
+static const NodeOps mb_ops = { mb_send, NULL, NULL, NULL, mb_now_ms };
+
+static long long wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Node with pids [0, n_pids-1] as members and `depth` requests queued. */
+static Node *make_node(int n_pids, int depth) {
+    Node *n = malloc(sizeof(Node));
+    N = n_pids;
+    node_init(n, 0, &mb_ops, NULL);
+    n->quiet = 1;
+    for (int i = 0; i < n_pids; ++i) add_member(n, i);
+    for (int i = 0; i < depth; ++i) queue_insert(n, 2 * i + 2, i % n_pids, 0);
+    return n;
+}
+static void free_node(Node *n) {
+    free(n->queue);
+    free(n);
+}
+
+/* Pseudo-random values, drawn before timing starts. */
+static int *rnd;
+#define RND_LEN 4096
+static void fill_rnd(int bound) {
+    unsigned long long s = 88172645463325252ULL;
+    for (int i = 0; i < RND_LEN; ++i) {
+        s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+        rnd[i] = (int)(s % (unsigned long long)bound);
+    }
+}
+
+/* One benchmark: `body` runs `count` operations of thread `tid` on `n`. */
+typedef struct Bench {
+    const char *name;
+    void (*body)(Node *n, int tid, long long count);
+} Bench;
+
+static void b_queue_insert_remove(Node *n, int tid, long long count) {
+    (void)tid;
+    int depth = queue_depth(n);
+    for (long long i = 0; i < count; ++i) {
+        int lc = rnd[i & (RND_LEN - 1)] % (2 * depth + 2) * 2 + 1;
+        queue_insert(n, lc, MAX_PEERS - 1, 0);
+        queue_remove(n, lc, MAX_PEERS - 1);
+    }
+}
+static void b_queue_head_is(Node *n, int tid, long long count) {
+    (void)tid;
+    long long hits = 0;
+    for (long long i = 0; i < count; ++i) hits += queue_head_is(n, 2, 0);
+    sink = hits;
+}
+static void b_inc_lc(Node *n, int tid, long long count) {
+    (void)tid;
+    long long s = 0;
+    for (long long i = 0; i < count; ++i) s += inc_lc(n);
+    sink = s;
+}
+static void b_update_lc(Node *n, int tid, long long count) {
+    long long s = 0;
+    for (long long i = 0; i < count; ++i) s += update_lc_on_receive(n, (int)(i + tid) & 0xffff);
+    sink = s;
+}
+static void b_all_acks_ge(Node *n, int tid, long long count) {
+    (void)tid;
+    long long s = 0;
+    for (long long i = 0; i < count; ++i) s += all_acks_ge(n, 1);
+    sink = s;
+}
+/* A REQ from pid 1 (answered with an ACK) and its REL: one op is both lines */
+static char (*req_lines)[64], (*rel_lines)[64];
+static void b_process_req_rel(Node *n, int tid, long long count) {
+    (void)tid;
+    for (long long i = 0; i < count; ++i) {
+        process_line(n, req_lines[i & (RND_LEN - 1)]);
+        process_line(n, rel_lines[i & (RND_LEN - 1)]);
+    }
+}
+static void b_process_ack(Node *n, int tid, long long count) {
+    (void)tid;
+    for (long long i = 0; i < count; ++i) process_line(n, "ACK 12345 1 7 0");
+}
+
+typedef struct Worker {
+    const Bench *b;
+    Node *n;
+    int tid;
+    long long count;
+    pthread_barrier_t *start;
+} Worker;
+
+static void *worker(void *arg) {
+    Worker *w = arg;
+    pthread_barrier_wait(w->start);
+    w->b->body(w->n, w->tid, w->count);
+    return NULL;
+}
+
+/* Run `b` on `n` with `threads` threads sharing `iters` operations; prints one row */
+static void run(const Bench *b, Node *n, const char *param, int threads) {
+    if (only && strcmp(only, b->name) != 0) return;
+    b->body(n, 0, iters / 100 + 1); /* warm up */
+    pthread_t t[threads];
+    Worker w[threads];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    long long per = iters / threads;
+    for (int i = 0; i < threads; ++i) {
+        w[i] = (Worker){ b, n, i, per, &start };
+        pthread_create(&t[i], NULL, worker, &w[i]);
+    }
+    long long t0 = wall_ns();
+    unsigned long long c0 = cycles();
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < threads; ++i) pthread_join(t[i], NULL);
+    unsigned long long c1 = cycles();
+    long long t1 = wall_ns();
+    pthread_barrier_destroy(&start);
+    double ops = (double)per * threads;
+    printf("%-22s %-12s %7d %10.1f %10.1f\n", b->name, param, threads, (t1 - t0) / ops,
+           c1 > c0 ? (c1 - c0) / ops : 0.0);
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --iters <k>    operations per measurement (default 1000000)\n"
+            "  --only <name>  run only this benchmark\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        {"iters", required_argument, NULL, 'i'},
+        {"only", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'i': iters = atoll(optarg); break;
+        case 'o': only = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (iters <= 0 || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    rnd = malloc(RND_LEN * sizeof(int));
+    fill_rnd(1 << 20);
+    req_lines = malloc(RND_LEN * sizeof(*req_lines));
+    rel_lines = malloc(RND_LEN * sizeof(*rel_lines));
+
+    static const Bench queue_insert_remove = { "queue_insert_remove", b_queue_insert_remove };
+    static const Bench queue_head_is_b = { "queue_head_is", b_queue_head_is };
+    static const Bench process_req_rel = { "process_line_req_rel", b_process_req_rel };
+    static const Bench process_ack = { "process_line_ack", b_process_ack };
+    static const Bench inc = { "inc_lc", b_inc_lc };
+    static const Bench update = { "update_lc_on_receive", b_update_lc };
+    static const Bench acks = { "all_acks_ge", b_all_acks_ge };
+    static const int depths[] = { 1, 16, 256, 1023 };
+    static const int pid_counts[] = { 2, 16, 128, 1024 };
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    char param[32];
+
+    printf("%-22s %-12s %7s %10s %10s\n", "benchmark", "state", "threads", "ns/op", "cycles/op");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+        Node *n = make_node(MAX_PEERS, depths[d]);
+        snprintf(param, sizeof(param), "depth=%d", depths[d]);
+        run(&queue_insert_remove, n, param, 1);
+        run(&queue_head_is_b, n, param, 1);
+        /* REQs from pid 1 at clocks between the queued ones, then their RELs */
+        for (int i = 0; i < RND_LEN; ++i) {
+            int lc = rnd[i] % (2 * depths[d] + 2) * 2 + 1;
+            snprintf(req_lines[i], sizeof(req_lines[i]), "REQ %d 1 0", lc);
+            snprintf(rel_lines[i], sizeof(rel_lines[i]), "REL %d %d 1 0", lc + 1, lc);
+        }
+        run(&process_req_rel, n, param, 1);
+        run(&process_ack, n, param, 1);
+        free_node(n);
+    }
+    for (size_t p = 0; p < sizeof(pid_counts) / sizeof(pid_counts[0]); ++p) {
+        Node *n = make_node(pid_counts[p], 0);
+        for (int i = 0; i < pid_counts[p]; ++i) set_ack(n, i, 1);
+        snprintf(param, sizeof(param), "N=%d", pid_counts[p]);
+        run(&acks, n, param, 1);
+        free_node(n);
+    }
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t) {
+        Node *n = make_node(16, 0);
+        run(&inc, n, "-", thread_counts[t]);
+        run(&update, n, "-", thread_counts[t]);
+        free_node(n);
+    }
+    return 0;
+}
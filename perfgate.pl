@@ -0,0 +1,144 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Temp qw(tempdir);
+
+# Usage: ./perfgate.pl [--runs 5] [--max-runs 30] [--tolerance 10] [--base-port 30000]
+#                      [--baseline perf-baseline.csv] [--update]
+# Runs a fixed set of ./bench.pl configurations and compares the mean
+# throughput (locks/s) and p99 grant latency of each to the baseline file,
+# with 95% confidence intervals (Student t) over the runs. It runs the set
+# at least --runs times, and again (up to --max-runs) until the half-width
+# of every interval is within --tolerance percent of its mean. A metric
+# regresses when it is worse than its baseline by more than --tolerance
+# percent and by more than the combined half-widths of both intervals;
+# metrics still noisier than the tolerance after --max-runs are marked
+# "noisy", as only a larger regression fails them. Exits 1 on any
+# regression, after a report of every metric. --update measures and
+# rewrites the baseline instead. The processes listen from --base-port up,
+# away from the ports of run_all.pl and of bench.pl runs.
+#
+# The baseline holds absolute numbers, so it is only valid on the machine
+# it was measured on: regenerate it with --update (`make perf-baseline`) on
+# every machine the gate runs on, and after changes to the machine.
+
+my $runs = 5;
+my $max_runs = 30;
+my $tolerance = 10;
+my $base_port = 30000;
+my $baseline = "perf-baseline.csv";
+my $update = 0;
+GetOptions("runs=i" => \$runs, "max-runs=i" => \$max_runs, "tolerance=f" => \$tolerance,
+           "base-port=i" => \$base_port, "baseline=s" => \$baseline, "update" => \$update)
+	or die "Usage: $0 [--runs k] [--max-runs k] [--tolerance percent] [--base-port port] [--baseline file] [--update]\n";
+die "--runs must be at least 2\n" if $runs < 2;
+$max_runs = $runs if $max_runs < $runs;
+
+# The fixed benchmark set: bench.pl arguments. Every run lasts about a
+# second, as shorter ones mostly measure the start of the processes.
+my @set = (
+	["--n", "4", "--patterns", "all", "--transports", "tcp", "--leases", "off", "--locks", "3000"],
+	["--n", "4", "--patterns", "all", "--transports", "local", "--leases", "off", "--locks", "5000"],
+	["--n", "16", "--patterns", "all", "--transports", "vnodes,local", "--batching", "on", "--leases", "off", "--locks", "500"],
+	["--n", "16", "--patterns", "single", "--transports", "vnodes,local", "--batching", "on", "--leases", "off", "--locks", "3000"],
+);
+
+# 97.5% quantiles of Student's t for 1..30 degrees of freedom
+my @t975 = (0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042);
+
+sub mean_ci {
+	my @x = @_;
+	my $n = @x;
+	my $mean = 0;
+	$mean += $_ / $n for @x;
+	my $var = 0;
+	$var += ($_ - $mean) ** 2 / ($n - 1) for @x;
+	my $t = $n - 1 <= 30 ? $t975[$n - 1] : 1.960;
+	return ($mean, $t * sqrt($var / $n));
+}
+
+# Measure: samples{"<config>"}{metric} = [values over the runs]
+my $dir = tempdir("perfgate.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my (%samples, @order, %now);
+my $failed_runs = 0;
+my $rounds = 0;
+for my $run (1 .. $max_runs) {
+	$rounds = $run;
+	for my $args (@set) {
+		system("./bench.pl", @$args, "--base-port", $base_port, "--no-plot", "--out", "$dir/run.csv") == 0
+			or die "bench.pl failed\n";
+		open(my $fh, '<', "$dir/run.csv") or die "$dir/run.csv: $!";
+		<$fh>;
+		while (my $l = <$fh>) {
+			chomp $l;
+			my @c = split /,/, $l;
+			my $config = "n=$c[0] $c[1] $c[2] batch=$c[3] lease=$c[4]";
+			if ($c[13] ne "ok") {
+				print "$config: run $run $c[13]\n";
+				$failed_runs++;
+				next;
+			}
+			push @order, $config unless $samples{$config};
+			push @{$samples{$config}{locks_per_s}}, $c[7];
+			push @{$samples{$config}{p99_us}}, $c[11];
+		}
+		close($fh);
+	}
+	my $noisy = 0;
+	for my $config (@order) {
+		for my $metric ("locks_per_s", "p99_us") {
+			my @x = @{$samples{$config}{$metric}};
+			$now{$config}{$metric} = [scalar(@x), @x > 1 ? mean_ci(@x) : ($x[0], 0)];
+			my (undef, $mean, $ci) = @{$now{$config}{$metric}};
+			$noisy++ if @x < 2 || $ci > $mean * $tolerance / 100;
+		}
+	}
+	last if $run >= $runs && !$noisy;
+}
+print "measured over $rounds runs\n";
+
+if ($update) {
+	open(my $fh, '>', $baseline) or die "$baseline: $!";
+	print $fh "config,metric,runs,mean,ci95\n";
+	for my $config (@order) {
+		for my $metric ("locks_per_s", "p99_us") {
+			printf $fh "%s,%s,%d,%.1f,%.1f\n", $config, $metric, @{$now{$config}{$metric}};
+		}
+	}
+	close($fh);
+	print "baseline written to $baseline\n";
+	exit($failed_runs ? 1 : 0);
+}
+
+open(my $fh, '<', $baseline) or die "$baseline: $! (create it with --update)\n";
+<$fh>;
+my $regressions = 0;
+printf "%-40s %-12s %20s %20s %8s\n", "config", "metric", "baseline", "now", "change";
+while (my $l = <$fh>) {
+	chomp $l;
+	my ($config, $metric, $bruns, $bmean, $bci) = split /,/, $l;
+	my $m = $now{$config}{$metric};
+	if (!$m) {
+		printf "%-40s %-12s %20s %20s %8s  REGRESSION (no successful run)\n", $config, $metric,
+			sprintf("%.0f +- %.0f", $bmean, $bci), "-", "-";
+		$regressions++;
+		next;
+	}
+	my (undef, $mean, $ci) = @$m;
+	# positive = worse: less throughput, more latency
+	my $worse = $metric eq "locks_per_s" ? $bmean - $mean : $mean - $bmean;
+	my $noise = sqrt($bci ** 2 + $ci ** 2);
+	my $allowed = $bmean * $tolerance / 100;
+	$allowed = $noise if $noise > $allowed;
+	my $verdict = $worse > $allowed ? "REGRESSION" : "ok";
+	$verdict .= " (noisy)" if $bci > $bmean * $tolerance / 100 || $ci > $mean * $tolerance / 100;
+	$regressions++ if $worse > $allowed;
+	printf "%-40s %-12s %20s %20s %+7.1f%%  %s\n", $config, $metric, sprintf("%.0f +- %.0f", $bmean, $bci),
+		sprintf("%.0f +- %.0f", $mean, $ci), $bmean ? ($mean - $bmean) * 100 / $bmean : 0, $verdict;
+}
+close($fh);
+print $regressions ? "$regressions regression(s) beyond $tolerance% and the noise\n" : "no regression\n";
+exit($regressions ? 1 : 0);
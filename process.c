@@ -1,422 +1,2310 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/perf_event.h>
+#include <linux/sockios.h>
+
+#include "lamport.h"
+#include "lockd.h"
+#include "script.h"
+
 #define BASE_PORT 50000
-#define MAXLINE 4096
 #define RETRY_USEC 100000
-#define MAX_PEERS 128
-
-int N = 0;
-int my_pid = -1;
-int total_locks = 0; /* total number of Lock instructions in the input file (global termination) */
-
-/* Lamport clock */
-/* Lamport clock (logical clock) and helpers. */
-static int lc = 0;
-static pthread_mutex_t lc_m = PTHREAD_MUTEX_INITIALIZER;
-/* Increment logical clock and return new value. */
-static int inc_lc(void) {
-    pthread_mutex_lock(&lc_m);
-    lc++;
-    int tmp = lc;
-    pthread_mutex_unlock(&lc_m);
-    return tmp;
-}
-/* Update local logical clock after receiving a timestamp. */
-static int update_lc_on_receive(int remote_lc) {
-    pthread_mutex_lock(&lc_m);
-    if (remote_lc >= lc) lc = remote_lc + 1;
-    int tmp = lc;
-    pthread_mutex_unlock(&lc_m);
-    return tmp;
-}
-
-/* Request queue ordered by (req_lc, req_pid) */
-typedef struct ReqEntry {
-    int req_lc;
-    int req_pid;
-    struct ReqEntry *next;
-} ReqEntry;
-/* Request queue ordered by (req_lc, req_pid). */
-static ReqEntry *queue_head = NULL;
-static pthread_mutex_t queue_m = PTHREAD_MUTEX_INITIALIZER;
-
-/* Insert a request into the ordered queue. */
-static void queue_insert(int req_lc, int req_pid) {
-    pthread_mutex_lock(&queue_m);
-    ReqEntry **pp = &queue_head;
-    while (*pp) {
-        if ((*pp)->req_lc < req_lc) { pp = &(*pp)->next; continue; }
-        if ((*pp)->req_lc == req_lc && (*pp)->req_pid < req_pid) { pp = &(*pp)->next; continue; }
-        break;
-    }
-    ReqEntry *e = malloc(sizeof(ReqEntry));
-    e->req_lc = req_lc; e->req_pid = req_pid; e->next = *pp;
-    *pp = e;
-    pthread_mutex_unlock(&queue_m);
-}
-
-/* Remove a request from the queue (if present). */
-static void queue_remove(int req_lc, int req_pid) {
-    pthread_mutex_lock(&queue_m);
-    ReqEntry **pp = &queue_head;
-    while (*pp) {
-        if ((*pp)->req_lc == req_lc && (*pp)->req_pid == req_pid) {
-            ReqEntry *to = *pp;
-            *pp = to->next;
-            free(to);
+#define CONNECT_WAIT_MS 1000 /* connector thread: wait for one connect */
+#define HEARTBEAT_MS 500
+#define SUSPECT_MS 5000
+#define MONITOR_TICK_MS 100
+#define WAKE_MS 100
+
+/* The input file, and the Lock instructions it gives each process (global
+   termination; kept per pid so that dead peers can be discounted). */
+static Script script;
+static long long locks_per_pid[MAX_PEERS];
+
+static int heartbeat_ms = HEARTBEAT_MS; /* interval between HB messages */
+static int suspect_ms = SUSPECT_MS;     /* silence after which a peer is suspected (0 = never) */
+static int lease_ms = 0;                /* lease slack on top of the Lock duration (0 = no leases) */
+static int join_mode = 0;               /* join a running mesh instead of starting with it */
+static const char *daemon_sock = NULL;  /* serve local clients on this Unix socket instead of a script */
+static int vnodes = 1;                  /* participants per OS process (host) */
+static const char *config_file = NULL;  /* cluster configuration (--config) */
+static int base_port = BASE_PORT;       /* pid i listens on base_port + i without --config */
+static int relay = 0;                   /* one copy of each broadcast per remote host */
+static const char *metrics_addr = NULL; /* serve metrics on this endpoint */
+static const char *admin_sock = NULL;   /* serve state dumps on this Unix socket */
+static const char *record_prefix = NULL; /* record what each node handles to <prefix>.<pid> */
+static int bench = 0;                   /* benchmark mode: no ./critical, report latencies */
+static double bench_rate = 0;           /* bench: Poisson arrivals of Locks per second per pid (0 = closed loop) */
+static const char *bench_arrivals;      /* bench: trace of Lock arrival times */
+static long long bench_think_us = 0;    /* bench, closed loop: mean think time before each Lock */
+static int bench_counters = 0;          /* bench: count CPU events per lock with perf_event_open */
+static int critical_worker = 0;         /* run critical sections in one `./critical --serve` */
+enum { SPAWN_SYSTEM, SPAWN_POSIX, SPAWN_ZYGOTE };
+static int spawn_mode = SPAWN_SYSTEM;   /* how ./critical is started per lock (--spawn) */
+
+/* Virtual participants hosted by this OS process: pids [first_pid, first_pid + nlocal). */
+static int first_pid = -1;
+static int nlocal = 0;
+static Node *nodes;
+
+/* Monotonic time in milliseconds. */
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/* Monotonic time in microseconds. */
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Cluster configuration. By default every process hosts `vnodes` consecutive
+   pids and listens on 127.0.0.1:base_port + its first pid. A --config file
+   instead gives the endpoints of each pid, one pid per line:
+
+       # pid  endpoint [endpoint]
+       0      10.0.0.1:50000
+       1      [fd00::2]:50000  unix:/tmp/lock1.sock
+       link   0 1 unix
+
+   An endpoint is `host:port` (a name or an IPv4 address, resolved with
+   getaddrinfo), `[ipv6]:port` or `unix:<path>`; a process listens on all the
+   endpoints of its pids. Consecutive pids sharing their first endpoint are
+   hosted by one process, whose id is the lowest of them. Peers are reached
+   through their first endpoint, unless a `link <a> <b> tcp|unix` line picks
+   the transport of the connections between the processes of a and b (for
+   the directions where the receiver has such an endpoint). */
+enum { TR_TCP, TR_UNIX, TR_COUNT };
+
+typedef struct Endpoint {
+    int set;
+    struct sockaddr_storage addr;
+    socklen_t len;
+} Endpoint;
+
+typedef struct LinkChoice {
+    int a, b, tr;
+} LinkChoice;
+
+static Endpoint endpoints[MAX_PEERS][TR_COUNT];
+static int first_tr[MAX_PEERS];     /* transport of the first endpoint of each pid */
+static int host_first[MAX_PEERS];   /* host of each configured pid */
+static int configured[MAX_PEERS];
+static LinkChoice *link_choices = NULL;
+static int n_link_choices = 0;
+
+/* The host of `pid` is the first pid of the process hosting it. */
+static int host_of(int pid) {
+    if (config_file) return pid >= 0 && pid < MAX_PEERS && configured[pid] ? host_first[pid] : pid;
+    return pid - pid % vnodes;
+}
+
+/* Parse one endpoint into `e`; returns its transport or -1. */
+static int parse_endpoint(const char *spec, Endpoint *e) {
+    memset(e, 0, sizeof(*e));
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&e->addr;
+        if (strlen(spec + 5) == 0 || strlen(spec + 5) >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        e->len = sizeof(*un);
+        e->set = 1;
+        return TR_UNIX;
+    }
+    char host[256];
+    const char *port;
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+        if (!end || end[1] != ':' || end - spec - 1 >= (long)sizeof(host)) return -1;
+        memcpy(host, spec + 1, end - spec - 1);
+        host[end - spec - 1] = '\0';
+        port = end + 2;
+    } else {
+        const char *colon = strrchr(spec, ':');
+        if (!colon || colon - spec >= (long)sizeof(host)) return -1;
+        memcpy(host, spec, colon - spec);
+        host[colon - spec] = '\0';
+        port = colon + 1;
+    }
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(rc));
+        return -1;
+    }
+    memcpy(&e->addr, res->ai_addr, res->ai_addrlen);
+    e->len = res->ai_addrlen;
+    e->set = 1;
+    freeaddrinfo(res);
+    return TR_TCP;
+}
+
+/* Load the --config file; returns 0 on success. */
+static int load_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("open config"); return -1; }
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0, rc = 0, prev_pid = -1;
+    char prev_first[MAXLINE] = "";
+    while (rc == 0 && getline(&line, &len, f) != -1) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        /* up to 4 words, pointing into the line (which getline sizes) */
+        char *w[4], *save, *tok;
+        int nw = 0;
+        for (tok = strtok_r(line, " \t\r\n", &save); tok && nw < 4; tok = strtok_r(NULL, " \t\r\n", &save))
+            w[nw++] = tok;
+        if (nw <= 0) continue;
+        const char *w0 = w[0], *w1 = nw > 1 ? w[1] : NULL, *w2 = nw > 2 ? w[2] : NULL, *w3 = nw > 3 ? w[3] : NULL;
+        rc = -1;
+        if (strcmp(w0, "link") == 0) {
+            if (nw != 4 || (strcmp(w3, "tcp") != 0 && strcmp(w3, "unix") != 0)) break;
+            link_choices = realloc(link_choices, (n_link_choices + 1) * sizeof(LinkChoice));
+            LinkChoice *l = &link_choices[n_link_choices++];
+            l->a = atoi(w1);
+            l->b = atoi(w2);
+            l->tr = strcmp(w3, "tcp") == 0 ? TR_TCP : TR_UNIX;
+            rc = 0;
+            continue;
+        }
+        int pid = atoi(w0);
+        if (nw < 2 || nw > 3 || pid < 0 || pid >= MAX_PEERS || configured[pid]) break;
+        Endpoint e;
+        int tr = parse_endpoint(w1, &e);
+        if (tr < 0) break;
+        endpoints[pid][tr] = e;
+        first_tr[pid] = tr;
+        if (nw == 3) {
+            int tr2 = parse_endpoint(w2, &e);
+            if (tr2 < 0 || tr2 == tr) break;
+            endpoints[pid][tr2] = e;
+        }
+        /* a run of consecutive pids with the same first endpoint is one process */
+        host_first[pid] = (pid == prev_pid + 1 && strcmp(w1, prev_first) == 0) ? host_first[prev_pid] : pid;
+        configured[pid] = 1;
+        prev_pid = pid;
+        snprintf(prev_first, sizeof(prev_first), "%s", w1);
+        rc = 0;
+    }
+    if (rc != 0) fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+/* Endpoint used to reach the process hosting pid `host`, or NULL. */
+static const Endpoint *endpoint_of(int host, int *tr) {
+    static Endpoint defaults[MAX_PEERS];
+    if (!config_file) {
+        /* default layout, filled on first use by the sender thread holding host_m */
+        Endpoint *e = &defaults[host];
+        if (!e->set) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&e->addr;
+            in->sin_family = AF_INET;
+            in->sin_addr.s_addr = inet_addr("127.0.0.1");
+            in->sin_port = htons(base_port + host);
+            e->len = sizeof(*in);
+            e->set = 1;
+        }
+        *tr = TR_TCP;
+        return e;
+    }
+    if (host < 0 || host >= MAX_PEERS || !configured[host]) return NULL;
+    *tr = first_tr[host];
+    for (int i = 0; i < n_link_choices; ++i) {
+        int a = host_of(link_choices[i].a), b = host_of(link_choices[i].b);
+        if (((a == first_pid && b == host) || (a == host && b == first_pid)) &&
+            endpoints[host][link_choices[i].tr].set) {
+            *tr = link_choices[i].tr;
             break;
         }
-        pp = &(*pp)->next;
     }
-    pthread_mutex_unlock(&queue_m);
+    return endpoints[host][*tr].set ? &endpoints[host][*tr] : NULL;
+}
+/* Return the hosted node with id `pid`, or NULL if it lives elsewhere. */
+static Node *local_node(int pid) {
+    if (pid < first_pid || pid >= first_pid + nlocal) return NULL;
+    return &nodes[pid - first_pid];
+}
+
+/* Wakeups for threads blocked on a node (lock_acquire, do_wait): the node's
+   `changed` hook bumps a generation counter; waiters also recheck every
+   WAKE_MS for conditions that change without a message (suspicion). */
+typedef struct Wake {
+    pthread_mutex_t m;
+    pthread_cond_t cv;
+    unsigned gen;
+} Wake;
+static Wake *wakes;
+
+static void node_changed(Node *n) {
+    Wake *w = n->ctx;
+    pthread_mutex_lock(&w->m);
+    w->gen++;
+    pthread_cond_broadcast(&w->cv);
+    pthread_mutex_unlock(&w->m);
+}
+/* Current generation; take it before testing the condition you wait for. */
+static unsigned wake_gen(Node *n) {
+    Wake *w = n->ctx;
+    pthread_mutex_lock(&w->m);
+    unsigned g = w->gen;
+    pthread_mutex_unlock(&w->m);
+    return g;
+}
+/* Block until the generation moves past `gen` or WAKE_MS elapsed. */
+static void wake_wait(Node *n, unsigned gen) {
+    Wake *w = n->ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += WAKE_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&w->m);
+    while (w->gen == gen) {
+        if (pthread_cond_timedwait(&w->cv, &w->m, &ts) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&w->m);
 }
 
-/* Check whether given request is at the head of the queue. */
-static int queue_head_is(int req_lc, int req_pid) {
-    pthread_mutex_lock(&queue_m);
-    int ok = 0;
-    if (queue_head && queue_head->req_lc == req_lc && queue_head->req_pid == req_pid) ok = 1;
-    pthread_mutex_unlock(&queue_m);
-    return ok;
+/* Failure detector: time of the last message from each pid, shared by all
+   hosted nodes. Heartbeats come per host and vouch for all of its pids. */
+static long long last_heard[MAX_PEERS];
+static pthread_mutex_t heard_m = PTHREAD_MUTEX_INITIALIZER;
+/* Record that pids [pid, pid+count) were just heard from. */
+static void heard_range(int pid, int count) {
+    long long t = now_ms();
+    pthread_mutex_lock(&heard_m);
+    for (int i = pid; i < pid + count && i < MAX_PEERS; ++i) {
+        if (i >= 0) last_heard[i] = t;
+    }
+    pthread_mutex_unlock(&heard_m);
+}
+static void node_heard(Node *n, int pid) {
+    (void)n;
+    heard_range(pid, 1);
 }
 
-/* Track ACKs for current request: store last ack logical clock per peer. */
-static int ack_lc[MAX_PEERS];
-static pthread_mutex_t ack_m = PTHREAD_MUTEX_INITIALIZER;
-/* Record an ACK from peer `from`. */
-static void set_ack(int from, int value) {
-    if (from < 0 || from >= MAX_PEERS) return;
-    pthread_mutex_lock(&ack_m);
-    ack_lc[from] = value;
-    pthread_mutex_unlock(&ack_m);
+/* NodeOps.excluded: a peer suspected this process and dropped it from the
+   mesh. Suspicion covers every pid of a host, so the whole process stops
+   (fail-stop), as the peers already assume it did. */
+static void node_excluded(Node *n, int by) {
+    printf("[proc %d] excluded from the mesh by proc %d, stopping\n", n->pid, by);
+    fflush(stdout);
+    _exit(3);
 }
-/* Return true if all peers have ACKed at least `target_lc`. */
-static int all_acks_ge(int target_lc) {
-    pthread_mutex_lock(&ack_m);
-    for (int i = 0; i < N; ++i) {
-        if (ack_lc[i] < target_lc) { pthread_mutex_unlock(&ack_m); return 0; }
+
+/* Metrics, served in the Prometheus text format by the metrics thread
+   (--metrics): message counts by type, bytes written, connections, and for
+   each hosted node its grants, grant latency histogram, queue depth, clock
+   and the lag of its clock behind the last clock heard from each peer. */
+static const char *msg_types[] = { "REQ", "ACK", "REL", "CANCEL", "EXP", "JOIN", "WELCOME", "LEAVE", "EXCLUDED", "HELLO", "HB", "other" };
+#define N_MSG_TYPES (int)(sizeof(msg_types) / sizeof(msg_types[0]))
+static const double latency_buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 };
+#define N_BUCKETS (int)(sizeof(latency_buckets) / sizeof(latency_buckets[0]))
+
+typedef struct NodeMetrics {
+    long long grants;
+    long long bucket[N_BUCKETS]; /* non-cumulative counts; +Inf is `grants` */
+    double latency_sum;          /* seconds */
+    int peer_lc[MAX_PEERS];      /* last clock heard from each peer, -1 = none */
+} NodeMetrics;
+
+static pthread_mutex_t metrics_m = PTHREAD_MUTEX_INITIALIZER;
+static long long sent_by_type[N_MSG_TYPES], received_by_type[N_MSG_TYPES];
+static long long bytes_written = 0;
+static int incoming_conns = 0;
+static int *incoming_fds = NULL; /* open incoming connections, for the admin dump */
+static NodeMetrics *node_metrics;
+
+/* Index of the type of message `msg` in msg_types. */
+static int msg_type(const char *msg) {
+    size_t len = strcspn(msg, " \n");
+    for (int i = 0; i < N_MSG_TYPES - 1; ++i) {
+        if (strlen(msg_types[i]) == len && strncmp(msg, msg_types[i], len) == 0) return i;
     }
-    pthread_mutex_unlock(&ack_m);
-    return 1;
+    return N_MSG_TYPES - 1;
+}
+static void count_sent(const char *msg, int copies) {
+    int t = msg_type(msg);
+    pthread_mutex_lock(&metrics_m);
+    sent_by_type[t] += copies;
+    pthread_mutex_unlock(&metrics_m);
+}
+/* Count a message delivered to hosted pid `pid` and note the sender's clock. */
+static void count_received(int pid, const char *msg) {
+    int t = msg_type(msg);
+    const char *args = msg + strcspn(msg, " ");
+    int lc, from = -1, parsed = 0;
+    /* "<TYPE> <lc> <sender> ...", but "REL|CANCEL <lc> <req_lc> <sender> ..." */
+    if (strcmp(msg_types[t], "REL") == 0 || strcmp(msg_types[t], "CANCEL") == 0)
+        parsed = sscanf(args, "%d %*d %d", &lc, &from);
+    else if (t != N_MSG_TYPES - 1)
+        parsed = sscanf(args, "%d %d", &lc, &from);
+    pthread_mutex_lock(&metrics_m);
+    received_by_type[t]++;
+    if (parsed == 2 && from >= 0 && from < MAX_PEERS) node_metrics[pid - first_pid].peer_lc[from] = lc;
+    pthread_mutex_unlock(&metrics_m);
+}
+static void count_grant(Node *n, long long latency_us) {
+    NodeMetrics *m = &node_metrics[n->pid - first_pid];
+    double sec = latency_us / 1e6;
+    pthread_mutex_lock(&metrics_m);
+    m->grants++;
+    m->latency_sum += sec;
+    for (int i = 0; i < N_BUCKETS; ++i) {
+        if (sec <= latency_buckets[i]) { m->bucket[i]++; break; }
+    }
+    pthread_mutex_unlock(&metrics_m);
 }
 
-/* Track releases seen per process for Wait semantics. */
-static int releases_seen[MAX_PEERS];
-static pthread_mutex_t rel_m = PTHREAD_MUTEX_INITIALIZER;
-/* Increment releases_seen counter for `pid`. */
-static void inc_release_seen(int pid) {
-    if (pid < 0 || pid >= MAX_PEERS) return;
-    pthread_mutex_lock(&rel_m);
-    releases_seen[pid] += 1;
-    pthread_mutex_unlock(&rel_m);
-}
-/* Read releases_seen for `pid`. */
-static int get_release_seen(int pid) {
-    if (pid < 0 || pid >= MAX_PEERS) return 0;
-    pthread_mutex_lock(&rel_m);
-    int v = releases_seen[pid];
-    pthread_mutex_unlock(&rel_m);
-    return v;
-}
-
-/* Send a short-lived TCP message to peer `pid` (connect, write, close). */
-static void send_short(int pid, const char *msg) {
-    if (pid < 0 || pid >= N) return;
-    struct sockaddr_in peeraddr;
-    peeraddr.sin_family = AF_INET;
-    peeraddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    peeraddr.sin_port = htons(BASE_PORT + pid);
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) return;
-    if (connect(s, (struct sockaddr*)&peeraddr, sizeof(peeraddr)) == 0) {
-        size_t len = strlen(msg);
-        ssize_t written = 0;
-        while ((size_t)written < len) {
-            ssize_t w = write(s, msg + written, len - written);
-            if (w <= 0) break;
-            written += w;
-        }
-        /* close connection */
-        close(s);
-    } else {
-        close(s);
+/* Transport. Each line on the wire is prefixed with its destination:
+   "@<pid> <msg>" for a hosted node, "@* <msg>" for the host itself (HELLO,
+   HB). There is one persistent outgoing TCP connection per remote host,
+   shared by all hosted nodes, opened lazily (or by the connector thread),
+   reused for every message so that links stay FIFO, and reopened once after
+   a write error. Incoming traffic arrives on the peer's own connection and
+   is read by the event loop. Messages between hosted nodes go through the
+   inbox, which the event loop drains like a socket.
+
+   Outgoing sockets are non-blocking, from the connect on: a sender writes
+   what the socket takes and leaves the rest in the host's OutBuf, which the
+   event loop writes once the socket is writable (EPOLLOUT); a connection in
+   progress is finished there too. An unreachable host thus never holds up
+   a sender for the SYN retries. Senders hold out_m, and the event loop
+   sends ACKs while it reads; with blocking writes, two processes whose
+   buffers fill toward each other would both stop reading. A host that lets
+   more than OUT_MAX bytes pile up is dropped as unreachable (the failure
+   detector then suspects it). */
+#define OUT_MAX (64 << 20)
+
+static int host_fd[MAX_PEERS];
+static pthread_mutex_t host_m[MAX_PEERS];
+static int loop_ep = -1;           /* epoll set of the event loop */
+static int host_ids[MAX_PEERS];    /* epoll data of the outgoing sockets: &host_ids[host] */
+
+/* Start a connection to the process hosting pid `host`; returns the socket,
+   with *pending set while the connect is in progress, or -1. */
+static int peer_connect(int host, int *pending) {
+    int tr;
+    const Endpoint *e = endpoint_of(host, &tr);
+    if (!e) return -1;
+    int s = socket(e->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (s < 0) return -1;
+    *pending = 0;
+    if (connect(s, (const struct sockaddr*)&e->addr, e->len) != 0) {
+        if (errno != EINPROGRESS) { /* refused, or a full Unix backlog (EAGAIN) */
+            close(s);
+            return -1;
+        }
+        *pending = 1;
+    }
+    if (tr == TR_TCP) {
+        int on = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     }
+    return s;
 }
 
-/* Broadcast `msg` to all other peers using short-lived connections. */
-static void broadcast_short(const char *msg) {
-    for (int i = 0; i < N; ++i) {
-        if (i == my_pid) continue;
-        send_short(i, msg);
+/* Write all of `len` bytes; returns 0 on success. */
+static int write_all(int s, const char *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t w = send(s, buf + written, len - written, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        written += w;
     }
+    return 0;
 }
 
-/* Forward declaration for incoming-line parser. */
-static void process_line(const char *line);
+/* Bytes for each remote host not written yet (ACKs combined by the relay,
+   or what the socket did not take), guarded by host_m and always written
+   before anything sent after them: data[off, len) is pending. */
+typedef struct OutBuf {
+    char *data;
+    size_t off, len, cap;
+    int armed;       /* the event loop waits for the socket to be writable */
+    int connecting;  /* the connect of the socket is in progress */
+} OutBuf;
+static OutBuf host_out[MAX_PEERS];
 
-/* Reader thread for a connected socket: read lines and dispatch them. */
-static void *conn_reader(void *arg) {
-    int s = *(int*)arg;
-    free(arg);
-    FILE *f = fdopen(s, "r");
-    if (!f) { close(s); return NULL; }
-    char buf[MAXLINE];
-    /* process every newline-terminated line */
-    while (fgets(buf, sizeof(buf), f)) {
-        process_line(buf);
+static void out_append(OutBuf *o, const char *buf, size_t len) {
+    if (o->off > 0) {
+        memmove(o->data, o->data + o->off, o->len - o->off);
+        o->len -= o->off;
+        o->off = 0;
+    }
+    if (o->len + len > o->cap) {
+        o->cap = (o->len + len) * 2;
+        o->data = realloc(o->data, o->cap);
+    }
+    memcpy(o->data + o->len, buf, len);
+    o->len += len;
+}
+
+/* Have the event loop flush `host` once its socket is writable, or not. */
+static void out_arm(int host, int on) {
+    OutBuf *o = &host_out[host];
+    if (o->armed == on || loop_ep < 0) return;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &host_ids[host];
+    epoll_ctl(loop_ep, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, host_fd[host], &ev);
+    o->armed = on;
+}
+
+static void out_close(int host) {
+    out_arm(host, 0);
+    close(host_fd[host]);
+    host_fd[host] = -1;
+    host_out[host].connecting = 0;
+}
+
+/* Write as much of the pending bytes of `host` as its socket takes now
+   (caller holds host_m[host]). Returns 0, or -1 if the host is unreachable
+   and the bytes were dropped. */
+static int flush_locked(int host) {
+    OutBuf *o = &host_out[host];
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (host_fd[host] < 0) host_fd[host] = peer_connect(host, &o->connecting);
+        if (host_fd[host] < 0) break;
+        if (o->connecting) {
+            out_arm(host, 1); /* the event loop writes once it is connected */
+            return 0;
+        }
+        size_t before = o->off;
+        ssize_t w = 0;
+        while (o->off < o->len) {
+            w = send(host_fd[host], o->data + o->off, o->len - o->off, MSG_NOSIGNAL);
+            if (w > 0) o->off += w;
+            else if (!(w < 0 && errno == EINTR)) break;
+        }
+        pthread_mutex_lock(&metrics_m);
+        bytes_written += o->off - before;
+        pthread_mutex_unlock(&metrics_m);
+        if (o->off == o->len) {
+            o->off = o->len = 0;
+            out_arm(host, 0);
+            return 0;
+        }
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (o->len - o->off > OUT_MAX) {
+                fprintf(stderr, "host %d does not read its messages: dropping the connection\n", host);
+                out_close(host);
+                break;
+            }
+            out_arm(host, 1);
+            return 0;
+        }
+        /* broken connection: send the line it cut again on a new one */
+        out_close(host);
+        while (o->off > 0 && o->data[o->off - 1] != '\n') o->off--;
+    }
+    o->off = o->len = 0;
+    return -1;
+}
+
+/* Send `len` bytes to remote host `host`. Returns 0, or -1 if unreachable. */
+static int send_host(int host, const char *buf, size_t len) {
+    pthread_mutex_lock(&host_m[host]);
+    out_append(&host_out[host], buf, len);
+    int rc = flush_locked(host);
+    pthread_mutex_unlock(&host_m[host]);
+    return rc;
+}
+
+/* Queue `len` bytes for `host` without writing them; returns 1 if nothing was
+   pending before. flush_host writes them. */
+static int queue_host(int host, const char *buf, size_t len) {
+    pthread_mutex_lock(&host_m[host]);
+    int first = host_out[host].len == 0;
+    out_append(&host_out[host], buf, len);
+    pthread_mutex_unlock(&host_m[host]);
+    return first;
+}
+static void flush_host(int host) {
+    pthread_mutex_lock(&host_m[host]);
+    if (host_out[host].len > host_out[host].off) flush_locked(host);
+    pthread_mutex_unlock(&host_m[host]);
+}
+
+/* Inbox of lines for hosted nodes, drained by the event loop. */
+typedef struct InMsg {
+    struct InMsg *next;
+    char line[];
+} InMsg;
+static InMsg *inbox_head = NULL, **inbox_tail = &inbox_head;
+static pthread_mutex_t inbox_m = PTHREAD_MUTEX_INITIALIZER;
+static int inbox_fd = -1; /* eventfd signalled when the inbox is not empty */
+
+static void inbox_push(const char *line, size_t len) {
+    InMsg *m = malloc(sizeof(InMsg) + len + 1);
+    memcpy(m->line, line, len + 1);
+    m->next = NULL;
+    pthread_mutex_lock(&inbox_m);
+    *inbox_tail = m;
+    inbox_tail = &m->next;
+    pthread_mutex_unlock(&inbox_m);
+    uint64_t one = 1;
+    ssize_t w = write(inbox_fd, &one, sizeof(one));
+    (void)w;
+}
+
+/* While the event loop fans a relayed broadcast out to its nodes, their
+   replies are queued per host and written together afterwards. */
+static __thread int in_fanout = 0;
+static int fanout_hosts[MAX_PEERS];
+static int n_fanout_hosts = 0;
+
+/* Hand a wire line for `dst` to the inbox or to the connection of its host. */
+static int deliver(int dst, const char *buf, size_t len) {
+    if (local_node(dst)) {
+        inbox_push(buf, len);
+        return 0;
+    }
+    int host = host_of(dst);
+    if (in_fanout) {
+        /* a host may be listed twice if another thread flushed it meanwhile */
+        if (queue_host(host, buf, len) && n_fanout_hosts < MAX_PEERS) fanout_hosts[n_fanout_hosts++] = host;
+        return 0;
+    }
+    return send_host(host, buf, len);
+}
+
+/* Network emulation (--emu-*): every message from pid `src` to pid `dst` is
+   held in user space before deliver() and released by the emulation thread
+   once due. A message is due after the link delay (--emu-delay-us, or the
+   --emu-link override of the pair) plus a uniform jitter in [0,
+   --emu-jitter-us], and after the bytes queued before it towards the same
+   host have drained at --emu-bandwidth-mbps. Messages towards a process keep
+   their order, as on its connection, unless --emu-reorder picks them (in
+   percent) to skip that rule; the algorithm assumes FIFO links, so
+   reordering is only meant to exercise it under violated assumptions. Jitter and reordering draw from a generator
+   seeded with --emu-seed and the first hosted pid. */
+#define EMU_OVERHEAD 66 /* Ethernet + IPv4 + TCP headers per message */
+
+typedef struct EmuLink {
+    int a, b;          /* pids, either direction */
+    long long delay_us;
+} EmuLink;
+
+static int emu_on = 0;
+static long long emu_delay_us = 0;
+static long long emu_jitter_us = 0;
+static double emu_bandwidth_mbps = 0; /* 0 = unlimited */
+static int emu_reorder = 0;           /* percent */
+static unsigned long long emu_seed = 1;
+static EmuLink *emu_links = NULL;
+static int emu_nlinks = 0;
+
+typedef struct EmuMsg {
+    long long due;
+    unsigned long long seq;
+    int dst;
+    size_t len;
+    char *buf;
+} EmuMsg;
+
+static pthread_mutex_t emu_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cv;
+static EmuMsg *emu_heap = NULL; /* min-heap on (due, seq) */
+static size_t emu_len = 0, emu_cap = 0;
+static unsigned long long emu_next_seq = 0;
+static unsigned long long emu_rng;
+static long long *emu_last_due; /* per (hosted src, dst host) */
+static long long emu_tx_free[MAX_PEERS]; /* per destination host */
+
+/* xorshift64* (caller holds emu_m) */
+static unsigned long long emu_rand(void) {
+    emu_rng ^= emu_rng >> 12;
+    emu_rng ^= emu_rng << 25;
+    emu_rng ^= emu_rng >> 27;
+    return emu_rng * 2685821657736338717ULL;
+}
+
+static long long emu_link_delay(int src, int dst) {
+    for (int i = 0; i < emu_nlinks; ++i) {
+        if ((emu_links[i].a == src && emu_links[i].b == dst) ||
+            (emu_links[i].a == dst && emu_links[i].b == src))
+            return emu_links[i].delay_us;
+    }
+    return emu_delay_us;
+}
+
+static int emu_less(const EmuMsg *x, const EmuMsg *y) {
+    return x->due < y->due || (x->due == y->due && x->seq < y->seq);
+}
+
+/* Queue a wire line from `src` (a hosted pid) to `dst`. */
+static int emu_send(int src, int dst, const char *buf, size_t len) {
+    EmuMsg m;
+    m.dst = dst;
+    m.len = len;
+    m.buf = malloc(len + 1);
+    memcpy(m.buf, buf, len + 1);
+    long long t = now_us();
+    pthread_mutex_lock(&emu_m);
+    if (emu_bandwidth_mbps > 0 && !local_node(dst)) {
+        long long *tx = &emu_tx_free[host_of(dst)];
+        if (*tx > t) t = *tx;
+        t += (long long)((len + EMU_OVERHEAD) * 8 / emu_bandwidth_mbps + 0.5);
+        *tx = t;
+    }
+    t += emu_link_delay(src, dst);
+    if (emu_jitter_us > 0) t += emu_rand() % (unsigned long long)(emu_jitter_us + 1);
+    long long *last = &emu_last_due[(size_t)(src - first_pid) * MAX_PEERS + host_of(dst)];
+    if (emu_reorder > 0 && (int)(emu_rand() % 100) < emu_reorder) {
+        /* may overtake earlier messages of the link */
+    } else {
+        if (t < *last) t = *last;
+        *last = t;
+    }
+    m.due = t;
+    m.seq = emu_next_seq++;
+    if (emu_len == emu_cap) {
+        emu_cap = emu_cap ? emu_cap * 2 : 256;
+        emu_heap = realloc(emu_heap, emu_cap * sizeof(EmuMsg));
+    }
+    size_t i = emu_len++;
+    while (i > 0 && emu_less(&m, &emu_heap[(i - 1) / 2])) {
+        emu_heap[i] = emu_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    emu_heap[i] = m;
+    if (i == 0) pthread_cond_signal(&emu_cv);
+    pthread_mutex_unlock(&emu_m);
+    return 0;
+}
+
+/* Emulation thread: deliver queued messages once they are due. */
+static void *emu_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&emu_m);
+    while (1) {
+        if (emu_len == 0) {
+            pthread_cond_wait(&emu_cv, &emu_m);
+            continue;
+        }
+        long long t = now_us();
+        if (emu_heap[0].due > t) {
+            struct timespec ts;
+            ts.tv_sec = emu_heap[0].due / 1000000;
+            ts.tv_nsec = (emu_heap[0].due % 1000000) * 1000;
+            pthread_cond_timedwait(&emu_cv, &emu_m, &ts);
+            continue;
+        }
+        EmuMsg m = emu_heap[0];
+        EmuMsg last = emu_heap[--emu_len];
+        size_t i = 0;
+        while (1) {
+            size_t c = 2 * i + 1;
+            if (c >= emu_len) break;
+            if (c + 1 < emu_len && emu_less(&emu_heap[c + 1], &emu_heap[c])) c++;
+            if (!emu_less(&emu_heap[c], &last)) break;
+            emu_heap[i] = emu_heap[c];
+            i = c;
+        }
+        if (emu_len > 0) emu_heap[i] = last;
+        pthread_mutex_unlock(&emu_m);
+        deliver(m.dst, m.buf, m.len);
+        free(m.buf);
+        pthread_mutex_lock(&emu_m);
     }
-    fclose(f);
     return NULL;
 }
 
-/* Server thread: bind/listen on BASE_PORT+my_pid and accept connections. */
-static void *server_thread(void *arg) {
+/* Parse "<a>-<b>:<delay_us>" for --emu-link; returns 0 on success. */
+static int emu_add_link(const char *spec) {
+    EmuLink l;
+    if (sscanf(spec, "%d-%d:%lld", &l.a, &l.b, &l.delay_us) != 3 || l.delay_us < 0) return -1;
+    emu_links = realloc(emu_links, (emu_nlinks + 1) * sizeof(EmuLink));
+    emu_links[emu_nlinks++] = l;
+    return 0;
+}
+
+static int emu_start(void) {
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&emu_cv, &ca);
+    emu_rng = (emu_seed ^ ((unsigned long long)first_pid << 32)) | 1;
+    emu_last_due = calloc((size_t)nlocal * MAX_PEERS, sizeof(long long));
+    pthread_t t;
+    return pthread_create(&t, NULL, emu_thread, NULL);
+}
+
+/* Send a wire line from hosted pid `src` to `dst`, through the emulation if enabled. */
+static int link_send(int src, int dst, const char *buf, size_t len) {
+    if (emu_on) return emu_send(src, dst, buf, len);
+    return deliver(dst, buf, len);
+}
+
+/* NodeOps.send: route `msg` to `dst`, locally or over its host's connection. */
+static int transport_send(Node *n, int dst, const char *msg) {
+    char buf[MAXLINE + 16];
+    int len = snprintf(buf, sizeof(buf), "@%d %s", dst, msg);
+    if (len >= (int)sizeof(buf)) return -1;
+    count_sent(msg, 1);
+    return link_send(n->pid, dst, buf, len);
+}
+
+/* NodeOps.multicast (--relay): one line per destination host, addressed to
+   the list of its pids as ranges ("@3-7,9 <msg>"); the receiving event loop
+   fans it out to those nodes. Lines leave in the same order as unicasts, on
+   the same connections, so each sender stays FIFO towards each node. */
+#define DSTLIST_MAX 2048
+static void transport_multicast(Node *n, const int *dsts, int count, const char *msg) {
+    char buf[DSTLIST_MAX + MAXLINE + 2];
+    for (int i = 0; i < count; ) {
+        int host = host_of(dsts[i]);
+        int j = i, len = 1, fits = 1;
+        buf[0] = '@';
+        while (j < count && host_of(dsts[j]) == host) {
+            int k = j;
+            while (k + 1 < count && dsts[k + 1] == dsts[k] + 1 && host_of(dsts[k + 1]) == host) k++;
+            int w = k > j ? snprintf(buf + len, DSTLIST_MAX - len, "%s%d-%d", j > i ? "," : "", dsts[j], dsts[k])
+                          : snprintf(buf + len, DSTLIST_MAX - len, "%s%d", j > i ? "," : "", dsts[j]);
+            if (w >= DSTLIST_MAX - len) fits = 0;
+            else len += w;
+            j = k + 1;
+        }
+        if (!fits) {
+            for (int k = i; k < j; ++k) transport_send(n, dsts[k], msg);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len, " %s", msg);
+            count_sent(msg, j - i);
+            link_send(n->pid, dsts[i], buf, len);
+        }
+        i = j;
+    }
+}
+
+static const NodeOps node_ops = { transport_send, NULL, node_heard, node_changed, now_ms, node_excluded };
+static const NodeOps relay_ops = { transport_send, transport_multicast, node_heard, node_changed, now_ms, node_excluded };
+
+/* Recording (--record <prefix>): every hosted node logs to <prefix>.<pid> the
+   messages it handles and the operations its owner performs on it, in the
+   order they reach it, so that ./replay can run the protocol logic again on
+   the same input. After a "# pid <pid> N <n>" header, one line each:
+   "<us> R <message>" or "<us> L <operation> [args]", with the time in
+   microseconds since the start. Operations are logged when they are issued,
+   without a lock around the call, so one may swap with a message that
+   reached the node at the same moment. */
+static FILE **rec_files;
+static long long rec_start;
+
+static void rec(Node *n, const char *fmt, ...) {
+    if (!rec_files) return;
+    FILE *f = rec_files[n->pid - first_pid];
+    va_list ap;
+    va_start(ap, fmt);
+    flockfile(f);
+    fprintf(f, "%lld ", now_us() - rec_start);
+    vfprintf(f, fmt, ap);
+    putc('\n', f);
+    funlockfile(f);
+    va_end(ap);
+}
+
+static int rec_open(const char *prefix) {
+    rec_files = calloc(nlocal, sizeof(FILE *));
+    rec_start = now_us();
+    for (int k = 0; k < nlocal; ++k) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d", prefix, first_pid + k);
+        if (!(rec_files[k] = fopen(path, "w"))) {
+            perror(path);
+            return -1;
+        }
+        setvbuf(rec_files[k], NULL, _IOFBF, 1 << 16);
+        fprintf(rec_files[k], "# pid %d N %d\n", first_pid + k, N);
+    }
+    return 0;
+}
+
+/* Handle one line received from the wire or the inbox. */
+static void dispatch_line(const char *line) {
+    if (line[0] != '@') return;
+    if (line[1] == '*') {
+        /* "HELLO <first_pid> <count>" / "HB <first_pid> <count>": liveness of a host */
+        char type[16];
+        int pid, count;
+        if (sscanf(line + 2, "%15s %d %d", type, &pid, &count) == 3) heard_range(pid, count);
+        pthread_mutex_lock(&metrics_m);
+        received_by_type[msg_type(type)]++;
+        pthread_mutex_unlock(&metrics_m);
+        return;
+    }
+    char *rest;
+    long dst = strtol(line + 1, &rest, 10);
+    if (*rest == ' ') {
+        Node *n = local_node((int)dst);
+        if (n) {
+            count_received(n->pid, rest + 1);
+            rec(n, "R %s", rest + 1);
+            process_line(n, rest + 1);
+        }
+        return;
+    }
+    /* relayed broadcast: "@<ranges> <msg>", replies are combined per host */
+    const char *msg = strchr(line, ' ');
+    if (!msg) return;
+    msg++;
+    in_fanout = 1;
+    const char *p = line + 1;
+    while (p < msg) {
+        long a = strtol(p, &rest, 10), b = a;
+        if (*rest == '-') b = strtol(rest + 1, &rest, 10);
+        for (long pid = a; pid <= b && pid < MAX_PEERS; ++pid) {
+            Node *n = local_node((int)pid);
+            if (n) {
+                count_received(n->pid, msg);
+                rec(n, "R %s", msg);
+                process_line(n, msg);
+            }
+        }
+        if (rest == p || (*rest != ',' && *rest != ' ')) break;
+        p = rest + 1;
+    }
+    in_fanout = 0;
+    for (int i = 0; i < n_fanout_hosts; ++i) flush_host(fanout_hosts[i]);
+    n_fanout_hosts = 0;
+}
+
+/* A connection read by the event loop, with its partial line. */
+typedef struct Conn {
+    int fd;
+    size_t len;
+    char buf[2 * MAXLINE];
+} Conn;
+
+/* Append what `c` has to read and dispatch every complete line; returns -1 on EOF. */
+static int conn_read(Conn *c) {
+    while (1) {
+        ssize_t r = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r <= 0) return -1;
+        c->len += r;
+        c->buf[c->len] = '\0';
+        char *start = c->buf, *nl;
+        while ((nl = strchr(start, '\n')) != NULL) {
+            *nl = '\0';
+            dispatch_line(start);
+            start = nl + 1;
+        }
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+        if (c->len == sizeof(c->buf) - 1) c->len = 0; /* oversized line: drop it */
+    }
+}
+
+/* CPU event counters of one thread (--counters), read together as a
+   perf_event_open group. A counter the kernel or the machine does not
+   provide (no PMU in a VM, perf_event_paranoid) is left out and reported as
+   n/a; when kernel events are not allowed, only user space is counted.
+   The CPU time (task-clock, in ns) needs no PMU. When the PMU has fewer
+   counters than asked for, the kernel multiplexes the group and it only
+   counts part of the time: the values are scaled by the time the group was
+   enabled over the time it ran, as perf stat does. */
+enum { CTR_CYCLES, CTR_INSTRUCTIONS, CTR_CACHE_MISSES, CTR_CSWITCHES, CTR_TASK_CLOCK, NCTR };
+static const char *const ctr_name[NCTR] = {
+    "cycles", "instructions", "cache-misses", "context-switches", "task-clock-ns"
+};
+static const struct { unsigned type; unsigned long long config; } ctr_event[NCTR] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+typedef struct Counters {
+    int fd;         /* group leader, -1 if nothing could be opened */
+    int pos[NCTR];  /* index of each counter in a group read, -1 if unavailable */
+    int n;
+    int user_only;
+} Counters;
+
+/* Open the counters of the calling thread. */
+static void counters_open(Counters *c) {
+    c->fd = -1;
+    c->n = 0;
+    c->user_only = 0;
+    for (int i = 0; i < NCTR; ++i) {
+        struct perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = ctr_event[i].type;
+        a.config = ctr_event[i].config;
+        a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        a.exclude_kernel = c->user_only;
+        a.exclude_hv = 1;
+        int fd = (int)syscall(SYS_perf_event_open, &a, 0, -1, c->fd, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && (errno == EACCES || errno == EPERM) && !c->user_only && c->fd < 0) {
+            c->user_only = a.exclude_kernel = 1;
+            fd = (int)syscall(SYS_perf_event_open, &a, 0, -1, c->fd, PERF_FLAG_FD_CLOEXEC);
+        }
+        c->pos[i] = fd < 0 ? -1 : c->n++;
+        if (fd >= 0 && c->fd < 0) c->fd = fd;
+    }
+}
+
+/* Current values into v (-1 for unavailable counters); -1 if none. */
+static int counters_read(const Counters *c, long long v[NCTR]) {
+    unsigned long long buf[3 + NCTR]; /* nr, time enabled, time running, values */
+    for (int i = 0; i < NCTR; ++i) v[i] = -1;
+    if (c->fd < 0 || read(c->fd, buf, sizeof(buf)) < (ssize_t)((3 + c->n) * sizeof(buf[0]))) return -1;
+    double scale = buf[2] > 0 ? (double)buf[1] / buf[2] : 0;
+    for (int i = 0; i < NCTR; ++i)
+        if (c->pos[i] >= 0) v[i] = (long long)(buf[3 + c->pos[i]] * scale);
+    return 0;
+}
+
+/* "[proc <pid>] counters <what> <locks> cycles=<per lock> ..." */
+static void counters_print(int pid, const char *what, long long locks, const long long v[NCTR], int user_only) {
+    flockfile(stdout);
+    printf("[proc %d] counters %s %lld", pid, what, locks);
+    for (int i = 0; i < NCTR; ++i) {
+        if (v[i] < 0 || locks <= 0) printf(" %s=n/a", ctr_name[i]);
+        else printf(" %s=%.1f", ctr_name[i], (double)v[i] / locks);
+    }
+    printf(user_only ? " (user space)\n" : "\n");
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+static Counters loop_counters = { .fd = -1 };
+
+/* Listening sockets of this process, one per transport. */
+static int listen_fd[TR_COUNT];
+static int n_listen = 0;
+
+/* Event loop: accept peer connections, read them and drain the inbox. */
+static void *event_loop(void *arg) {
     (void)arg;
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
-    int on = 1;
-    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(BASE_PORT + my_pid);
-    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (bench_counters) counters_open(&loop_counters);
+    int ep = loop_ep;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    for (int i = 0; i < n_listen; ++i) {
+        ev.data.ptr = &listen_fd[i];
+        epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd[i], &ev);
+    }
+    ev.data.ptr = &inbox_fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, inbox_fd, &ev);
+    struct epoll_event events[64];
+    while (1) {
+        int k = epoll_wait(ep, events, 64, -1);
+        for (int i = 0; i < k; ++i) {
+            void *p = events[i].data.ptr;
+            if (p >= (void *)listen_fd && p < (void *)(listen_fd + n_listen)) {
+                int c = accept4(*(int *)p, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (c < 0) continue;
+                pthread_mutex_lock(&metrics_m);
+                incoming_fds = realloc(incoming_fds, (incoming_conns + 1) * sizeof(int));
+                incoming_fds[incoming_conns++] = c;
+                pthread_mutex_unlock(&metrics_m);
+                Conn *conn = malloc(sizeof(Conn));
+                conn->fd = c;
+                conn->len = 0;
+                ev.events = EPOLLIN;
+                ev.data.ptr = conn;
+                epoll_ctl(ep, EPOLL_CTL_ADD, c, &ev);
+            } else if (p >= (void *)host_ids && p < (void *)(host_ids + MAX_PEERS)) {
+                /* an outgoing socket has room again, or finished connecting */
+                int h = *(int *)p;
+                pthread_mutex_lock(&host_m[h]);
+                if (host_fd[h] >= 0 && host_out[h].connecting) {
+                    int err = 0;
+                    socklen_t el = sizeof(err);
+                    getsockopt(host_fd[h], SOL_SOCKET, SO_ERROR, &err, &el);
+                    if (err != 0) {
+                        /* unreachable: drop what was queued, as a failed send does */
+                        out_close(h);
+                        host_out[h].off = host_out[h].len = 0;
+                    }
+                    host_out[h].connecting = 0;
+                }
+                if (host_fd[h] >= 0 && host_out[h].len > host_out[h].off) flush_locked(h);
+                else if (host_fd[h] >= 0) out_arm(h, 0);
+                pthread_mutex_unlock(&host_m[h]);
+            } else if (p == &inbox_fd) {
+                uint64_t cnt;
+                ssize_t r = read(inbox_fd, &cnt, sizeof(cnt));
+                (void)r;
+                pthread_mutex_lock(&inbox_m);
+                InMsg *m = inbox_head;
+                inbox_head = NULL;
+                inbox_tail = &inbox_head;
+                pthread_mutex_unlock(&inbox_m);
+                while (m) {
+                    InMsg *next = m->next;
+                    char *nl = strchr(m->line, '\n');
+                    if (nl) *nl = '\0';
+                    dispatch_line(m->line);
+                    free(m);
+                    m = next;
+                }
+            } else {
+                Conn *conn = p;
+                if (conn_read(conn) < 0) {
+                    epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+                    pthread_mutex_lock(&metrics_m);
+                    for (int j = 0; j < incoming_conns; ++j) {
+                        if (incoming_fds[j] == conn->fd) { incoming_fds[j] = incoming_fds[--incoming_conns]; break; }
+                    }
+                    close(conn->fd);
+                    pthread_mutex_unlock(&metrics_m);
+                    free(conn);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Bind/listen on `e` and add the socket to listen_fd. */
+static void listen_on(const Endpoint *e) {
+    int srv = socket(e->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (e->addr.ss_family == AF_UNIX) {
+        unlink(((const struct sockaddr_un *)&e->addr)->sun_path);
+    } else {
+        int on = 1;
+        setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(srv, (const struct sockaddr*)&e->addr, e->len) < 0) {
         perror("bind");
         exit(1);
     }
-    if (listen(srv, 20) < 0) {
+    if (listen(srv, 128) < 0) {
         perror("listen");
         exit(1);
     }
-    while (1) {
-        int c = accept(srv, NULL, NULL);
-        if (c < 0) continue;
-        int *p = malloc(sizeof(int));
-        *p = c;
-        pthread_t t;
-        pthread_create(&t, NULL, conn_reader, p);
-        pthread_detach(t);
+    listen_fd[n_listen++] = srv;
+}
+
+/* Listen on the endpoints of first_pid (by default, any address at base_port + first_pid). */
+static void open_server(void) {
+    if (config_file) {
+        for (int tr = 0; tr < TR_COUNT; ++tr)
+            if (endpoints[first_pid][tr].set) listen_on(&endpoints[first_pid][tr]);
+        return;
     }
-    return NULL;
+    Endpoint e;
+    memset(&e, 0, sizeof(e));
+    struct sockaddr_in *addr = (struct sockaddr_in *)&e.addr;
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = INADDR_ANY;
+    addr->sin_port = htons(base_port + first_pid);
+    e.len = sizeof(*addr);
+    listen_on(&e);
 }
 
-/* Connector thread: notify peers with an initial HELLO message. */
+/* Connector thread: open the persistent connection to every initial remote
+   host (retrying until it listens) and introduce ourselves with HELLO. */
 static void *connector_thread(void *arg) {
     (void)arg;
-    for (int i = 0; i < N; ++i) {
-        if (i == my_pid) continue;
-        struct sockaddr_in peeraddr;
-        peeraddr.sin_family = AF_INET;
-        peeraddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-        peeraddr.sin_port = htons(BASE_PORT + i);
-        while (1) {
-            int s = socket(AF_INET, SOCK_STREAM, 0);
-            if (connect(s, (struct sockaddr*)&peeraddr, sizeof(peeraddr)) == 0) {
-                char hello[64];
-                snprintf(hello, sizeof(hello), "HELLO %d\n", my_pid);
-                write(s, hello, strlen(hello));
-                close(s);
+    char hello[64];
+    int len = snprintf(hello, sizeof(hello), "@* HELLO %d %d\n", first_pid, nlocal);
+    for (int h = 0; h < N; ++h) {
+        if (h == first_pid || host_of(h) != h) continue;
+        while (!is_excluded(&nodes[0], h)) {
+            int pending, s = peer_connect(h, &pending);
+            if (s >= 0 && pending) {
+                /* this thread may wait for the connect, unlike a sender */
+                struct pollfd pf = { s, POLLOUT, 0 };
+                int err = 0;
+                socklen_t el = sizeof(err);
+                if (poll(&pf, 1, CONNECT_WAIT_MS) != 1 ||
+                    getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &el) != 0 || err != 0) {
+                    close(s);
+                    s = -1;
+                }
+            }
+            if (s >= 0) {
+                pthread_mutex_lock(&host_m[h]);
+                if (host_fd[h] < 0) host_fd[h] = s;
+                else close(s); /* a message already opened it */
+                pthread_mutex_unlock(&host_m[h]);
+                send_host(h, hello, len);
+                count_sent("HELLO", 1);
                 break;
-            } else {
-                close(s);
-                usleep(RETRY_USEC);
             }
+            usleep(RETRY_USEC);
         }
     }
     return NULL;
 }
 
-/* Parse and handle a single incoming textual message line. */
-static void process_line(const char *line) {
-    char type[16];
-    int a,b,c,d;
-    if (sscanf(line, "%15s %d %d %d %d", type, &a, &b, &c, &d) < 1) return;
-    if (strcmp(type, "HELLO") == 0) {
-        /* nothing to do for HELLO */
-        (void)a;
-    } else if (strcmp(type, "REQ") == 0) {
-        int req_lc = a;
-        int req_pid = b;
-        update_lc_on_receive(req_lc);
-        queue_insert(req_lc, req_pid);
-        /* send ACK: "ACK <ack_lc> <from_pid> <for_req_lc> <for_req_pid>\n" */
-        int mylc = inc_lc();
-        char buf[MAXLINE];
-        snprintf(buf, sizeof(buf), "ACK %d %d %d %d\n", mylc, my_pid, req_lc, req_pid);
-        send_short(req_pid, buf);
-    } else if (strcmp(type, "ACK") == 0) {
-        int ack_l = a, from = b, for_req_lc = c, for_req_pid = d;
-        update_lc_on_receive(ack_l);
-        /* If ACK is for our current request, record it */
-        if (for_req_pid == my_pid) set_ack(from, ack_l);
-    } else if (strcmp(type, "REL") == 0) {
-        int rel_lc = a, req_lc = b, req_pid = c;
-        update_lc_on_receive(rel_lc);
-        queue_remove(req_lc, req_pid);
-        inc_release_seen(req_pid);
-    }
-}
-
-/* Issue a REQ for the critical section and wait for permission. */
-static int do_request(int duration) {
-    int my_req_lc = inc_lc();
-    queue_insert(my_req_lc, my_pid);
-
-    pthread_mutex_lock(&ack_m);
-    for (int i = 0; i < N; ++i) ack_lc[i] = -1000000000;
-    ack_lc[my_pid] = my_req_lc; /* self-ack */
-    pthread_mutex_unlock(&ack_m);
-
-    char msg[MAXLINE];
-    snprintf(msg, sizeof(msg), "REQ %d %d\n", my_req_lc, my_pid);
-    broadcast_short(msg);
-
-    /* wait until head and all ACKs */
+/* Monitor thread: announce liveness, suspect silent peers and expire leases. */
+static void *monitor_thread(void *arg) {
+    (void)arg;
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "@* HB %d %d\n", first_pid, nlocal);
+    long long next_hb = 0, last_tick = now_ms(), grace_until = 0;
     while (1) {
-        usleep(100000);
-        if (!queue_head_is(my_req_lc, my_pid)) continue;
-        if (all_acks_ge(my_req_lc)) break;
+        usleep(MONITOR_TICK_MS * 1000);
+        long long t = now_ms();
+        /* after a stall of this process (stopped, swapped out), the silence
+           is ours: give the event loop time to read what arrived meanwhile
+           before suspecting anyone, and so before excluding the others */
+        if (t - last_tick > suspect_ms / 2) grace_until = t + suspect_ms;
+        last_tick = t;
+        if (suspect_ms > 0 && t >= next_hb) {
+            next_hb = t + heartbeat_ms;
+            /* one heartbeat per remote host that has a member or a suspected
+               pid: a suspected process that is only slow must not go on to
+               suspect us in turn before it learns it was excluded */
+            int last_host = -1;
+            for (int i = 0; i < N; ++i) {
+                int h = host_of(i);
+                if (h == first_pid || h == last_host) continue;
+                if (!is_member(&nodes[0], i) && !is_suspected(&nodes[0], i)) continue;
+                link_send(first_pid, h, msg, len);
+                count_sent("HB", 1);
+                last_host = h;
+            }
+            for (int i = 0; i < N && t >= grace_until; ++i) {
+                if (local_node(i)) continue;
+                pthread_mutex_lock(&heard_m);
+                int silent = t - last_heard[i] > suspect_ms;
+                pthread_mutex_unlock(&heard_m);
+                if (!silent) continue;
+                for (int k = 0; k < nlocal; ++k) {
+                    if (!is_member(&nodes[k], i)) continue;
+                    rec(&nodes[k], "L suspect %d %d", i, suspect_ms);
+                    suspect_peer(&nodes[k], i, suspect_ms);
+                }
+            }
+        }
+        if (lease_ms > 0) {
+            for (int k = 0; k < nlocal; ++k) {
+                rec(&nodes[k], "L expire");
+                node_expire_leases(&nodes[k]);
+            }
+        }
     }
+    return NULL;
+}
 
-    /* Granted: call critical (existing binary) exactly as required */
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "./critical %d %d", my_pid, duration);
-    printf("[proc %d] entering critical (duration=%d)\n", my_pid, duration);
+/* Write the metrics page to `f`. */
+static void render_metrics(FILE *f) {
+    pthread_mutex_lock(&metrics_m);
+    fprintf(f, "# HELP lock_messages_sent_total Messages sent, by type (one per destination).\n"
+               "# TYPE lock_messages_sent_total counter\n");
+    for (int t = 0; t < N_MSG_TYPES; ++t)
+        fprintf(f, "lock_messages_sent_total{type=\"%s\"} %lld\n", msg_types[t], sent_by_type[t]);
+    fprintf(f, "# HELP lock_messages_received_total Messages received, by type.\n"
+               "# TYPE lock_messages_received_total counter\n");
+    for (int t = 0; t < N_MSG_TYPES; ++t)
+        fprintf(f, "lock_messages_received_total{type=\"%s\"} %lld\n", msg_types[t], received_by_type[t]);
+    fprintf(f, "# HELP lock_bytes_written_total Bytes written to peer connections.\n"
+               "# TYPE lock_bytes_written_total counter\n"
+               "lock_bytes_written_total %lld\n", bytes_written);
+    int incoming = incoming_conns;
+    pthread_mutex_unlock(&metrics_m);
+
+    int outgoing = 0;
+    for (int h = 0; h < MAX_PEERS; ++h) {
+        pthread_mutex_lock(&host_m[h]);
+        outgoing += host_fd[h] >= 0;
+        pthread_mutex_unlock(&host_m[h]);
+    }
+    fprintf(f, "# HELP lock_connections Open peer connections.\n"
+               "# TYPE lock_connections gauge\n"
+               "lock_connections{direction=\"outgoing\"} %d\n"
+               "lock_connections{direction=\"incoming\"} %d\n", outgoing, incoming);
+
+    fprintf(f, "# HELP lock_queue_depth Requests in the queue of the node.\n"
+               "# TYPE lock_queue_depth gauge\n");
+    for (int k = 0; k < nlocal; ++k)
+        fprintf(f, "lock_queue_depth{pid=\"%d\"} %d\n", nodes[k].pid, queue_depth(&nodes[k]));
+    fprintf(f, "# HELP lock_lamport_clock Lamport clock of the node.\n"
+               "# TYPE lock_lamport_clock gauge\n");
+    int *clock = malloc(nlocal * sizeof(int));
+    for (int k = 0; k < nlocal; ++k) {
+        clock[k] = node_clock(&nodes[k]);
+        fprintf(f, "lock_lamport_clock{pid=\"%d\"} %d\n", nodes[k].pid, clock[k]);
+    }
+
+    pthread_mutex_lock(&metrics_m);
+    fprintf(f, "# HELP lock_peer_clock_lag Clock of the node minus the last clock heard from the peer.\n"
+               "# TYPE lock_peer_clock_lag gauge\n");
+    for (int k = 0; k < nlocal; ++k) {
+        for (int i = 0; i < N; ++i) {
+            if (node_metrics[k].peer_lc[i] < 0) continue;
+            fprintf(f, "lock_peer_clock_lag{pid=\"%d\",peer=\"%d\"} %d\n", nodes[k].pid, i,
+                    clock[k] - node_metrics[k].peer_lc[i]);
+        }
+    }
+    fprintf(f, "# HELP lock_grant_latency_seconds Time from request to grant.\n"
+               "# TYPE lock_grant_latency_seconds histogram\n");
+    for (int k = 0; k < nlocal; ++k) {
+        NodeMetrics *m = &node_metrics[k];
+        long long cum = 0;
+        for (int i = 0; i < N_BUCKETS; ++i) {
+            cum += m->bucket[i];
+            fprintf(f, "lock_grant_latency_seconds_bucket{pid=\"%d\",le=\"%g\"} %lld\n", nodes[k].pid,
+                    latency_buckets[i], cum);
+        }
+        fprintf(f, "lock_grant_latency_seconds_bucket{pid=\"%d\",le=\"+Inf\"} %lld\n", nodes[k].pid, m->grants);
+        fprintf(f, "lock_grant_latency_seconds_sum{pid=\"%d\"} %.6f\n", nodes[k].pid, m->latency_sum);
+        fprintf(f, "lock_grant_latency_seconds_count{pid=\"%d\"} %lld\n", nodes[k].pid, m->grants);
+    }
+    pthread_mutex_unlock(&metrics_m);
+    free(clock);
+}
+
+/* Metrics thread: answer every connection (any HTTP request) with the page. */
+static void *metrics_thread(void *arg) {
+    int srv = *(int*)arg;
+    while (1) {
+        int c = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0) continue;
+        struct timeval tv = { 1, 0 };
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        /* read the request head; its content does not matter */
+        char req[4096];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) {
+            ssize_t r = read(c, req + got, sizeof(req) - 1 - got);
+            if (r <= 0) break;
+            got += r;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+        }
+        char *body = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&body, &len);
+        render_metrics(f);
+        fclose(f);
+        char head[128];
+        int hl = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                              "Content-Length: %zu\r\n\r\n", len);
+        if (write_all(c, head, hl) == 0) write_all(c, body, len);
+        free(body);
+        close(c);
+    }
+    return NULL;
+}
+
+/* Listen on `spec` (a port on 127.0.0.1, host:port, [ipv6]:port or unix:path)
+   and start the metrics thread; returns 0 on success. */
+static int start_metrics(const char *spec) {
+    static int srv;
+    char full[300];
+    if (strspn(spec, "0123456789") == strlen(spec)) {
+        snprintf(full, sizeof(full), "127.0.0.1:%s", spec);
+        spec = full;
+    }
+    Endpoint e;
+    if (parse_endpoint(spec, &e) < 0) {
+        fprintf(stderr, "bad metrics endpoint %s\n", spec);
+        return -1;
+    }
+    srv = socket(e.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (e.addr.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un *)&e.addr)->sun_path);
+    } else {
+        int on = 1;
+        setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (srv < 0 || bind(srv, (struct sockaddr*)&e.addr, e.len) < 0 || listen(srv, 16) < 0) {
+        perror("metrics socket");
+        return -1;
+    }
+    pthread_t t;
+    return pthread_create(&t, NULL, metrics_thread, &srv);
+}
+
+/* Admin socket (--admin): every connection gets a text dump of the state of
+   each hosted node, taken with node_snapshot, and of the connections with
+   their backlog, then is closed. */
+static const char *peer_state_names[] = { "absent", "member", "left", "suspected" };
+
+static void dump_state(FILE *f) {
+    fprintf(f, "process %d: pids %d-%d, N %d\n", getpid(), first_pid, first_pid + nlocal - 1, N);
+    NodeSnapshot *snap = malloc(sizeof(NodeSnapshot));
+    for (int k = 0; k < nlocal; ++k) {
+        node_snapshot(&nodes[k], snap);
+        fprintf(f, "\n[pid %d] lc %d, request %d%s, holding %d, releases %d\n", snap->pid, snap->lc,
+                snap->cur_req_lc, snap->lease_lost ? " (lease lost)" : "", snap->held_req_lc,
+                snap->releases_seen[snap->pid]);
+        fprintf(f, "  queue (%d):", snap->queue_len);
+        long long t = now_ms();
+        for (int i = 0; i < snap->queue_len; ++i) {
+            ReqEntry *e = &snap->queue[i];
+            fprintf(f, " (%d,%d)", e->req_lc, e->req_pid);
+            if (e->lease_ms) fprintf(f, "[lease %d ms]", e->lease_ms);
+            if (i == 0) fprintf(f, "[head %lld ms]", t - e->head_since);
+        }
+        fprintf(f, "\n  %-6s %-10s %-8s %s\n", "peer", "state", "ack_lc", "releases");
+        for (int i = 0; i < snap->n; ++i) {
+            if (i == snap->pid || snap->peer_state[i] == PEER_ABSENT) continue;
+            fprintf(f, "  %-6d %-10s %-8d %d\n", i, peer_state_names[snap->peer_state[i]],
+                    snap->ack_lc[i], snap->releases_seen[i]);
+        }
+        free(snap->queue);
+    }
+    free(snap);
+
+    fprintf(f, "\nconnections:\n");
+    for (int h = 0; h < MAX_PEERS; ++h) {
+        pthread_mutex_lock(&host_m[h]);
+        if (host_fd[h] >= 0 || host_out[h].len > host_out[h].off) {
+            int unsent = 0;
+            if (host_fd[h] >= 0) ioctl(host_fd[h], SIOCOUTQ, &unsent);
+            fprintf(f, "  to %d: fd %d, %zu B queued, %d B in the socket\n", h, host_fd[h], host_out[h].len - host_out[h].off, unsent);
+        }
+        pthread_mutex_unlock(&host_m[h]);
+    }
+    pthread_mutex_lock(&metrics_m);
+    for (int i = 0; i < incoming_conns; ++i) {
+        int unread = 0;
+        ioctl(incoming_fds[i], SIOCINQ, &unread);
+        fprintf(f, "  from fd %d: %d B unread\n", incoming_fds[i], unread);
+    }
+    pthread_mutex_unlock(&metrics_m);
+    if (emu_on) {
+        pthread_mutex_lock(&emu_m);
+        fprintf(f, "  emulation: %zu messages delayed\n", emu_len);
+        pthread_mutex_unlock(&emu_m);
+    }
+}
+
+static void *admin_thread(void *arg) {
+    int srv = *(int*)arg;
+    while (1) {
+        int c = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0) continue;
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        dump_state(f);
+        fclose(f);
+        write_all(c, text, len);
+        free(text);
+        close(c);
+    }
+    return NULL;
+}
+
+static int start_admin(const char *path) {
+    static int srv;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "socket path too long\n"); return -1; }
+    strcpy(addr.sun_path, path);
+    srv = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (srv < 0 || bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(srv, 16) < 0) {
+        perror("admin socket");
+        return -1;
+    }
+    pthread_t t;
+    return pthread_create(&t, NULL, admin_thread, &srv);
+}
+
+/* Issue a REQ for the lock and wait for permission; `lease` is the lease in ms
+   (0 = none). Returns the fencing token of the grant. */
+static long long lock_acquire(Node *n, int lease) {
+    long long start = now_us();
+    while (1) {
+        rec(n, "L request %d", lease);
+        node_request(n, lease);
+        int st;
+        while (1) {
+            unsigned g = wake_gen(n);
+            if ((st = node_grant_state(n)) != 0) break;
+            wake_wait(n, g);
+        }
+        if (st > 0) {
+            count_grant(n, now_us() - start);
+            rec(n, "L enter");
+            return node_enter(n);
+        }
+        /* a peer expired the request before we were granted: withdraw and retry */
+        rec(n, "L cancel");
+        node_cancel(n);
+    }
+}
+
+/* Benchmark mode (--bench): a Lock instruction holds the lock for its
+   duration in microseconds instead of running ./critical, and every hosted
+   pid reports when its instructions are over, on one line:
+   "[proc <pid>] bench <locks> <elapsed_us> <latency_us>,<latency_us>,..."
+   with the time from each request to its grant.
+
+   By default the loop is closed: each Lock is asked for when the previous
+   instruction is over (after an exponential think time with --think-us).
+   With --rate or --arrivals the load is open: the k-th Lock of a pid
+   arrives at a set time (Poisson arrivals, or the k-th time of the pid in
+   the trace), whether or not the previous one was granted. A pid has one
+   request at a time, so arrivals during a backlog wait, and latency counts
+   from the arrival, not from when the request could be sent; otherwise a
+   slow grant would hide the delay of every arrival queued behind it
+   (coordinated omission).
+
+   With --counters every pid also reports the CPU events of its grant path
+   (asking for the lock until the grant, and the release) per lock:
+   "[proc <pid>] counters grant <locks> cycles=<n> ...". */
+typedef struct BenchRun {
+    long long start;
+    long long *lat;
+    size_t len, cap;
+    unsigned long long rng;
+    long long next;       /* --rate: arrival of the next Lock, in us */
+    long long *trace;     /* --arrivals: arrival offsets of its Locks, in us */
+    size_t ntrace;
+    Counters ctr;         /* --counters: of its instruction thread */
+    long long mark[NCTR], sum[NCTR];
+} BenchRun;
+static BenchRun *bench_runs;
+
+/* Add the events since bench_mark to the grant path counts of `n`. */
+static void bench_mark(Node *n) {
+    BenchRun *b = &bench_runs[n->pid - first_pid];
+    if (bench_counters) counters_read(&b->ctr, b->mark);
+}
+
+static void bench_count(Node *n) {
+    BenchRun *b = &bench_runs[n->pid - first_pid];
+    long long v[NCTR];
+    if (!bench_counters || counters_read(&b->ctr, v) != 0) return;
+    for (int i = 0; i < NCTR; ++i)
+        if (v[i] >= 0) b->sum[i] += v[i] - b->mark[i];
+}
+
+/* Exponential variate of mean `mean` (xorshift64* as for the emulation) */
+static double bench_exp(BenchRun *b, double mean) {
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    double u = ((b->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+    return -mean * log1p(-u);
+}
+
+/* Read the --arrivals trace: "<pid> <us>" lines, the arrival of the next
+   Lock of pid in microseconds from the start of its instructions. */
+static int bench_load_arrivals(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) { perror(filename); return -1; }
+    char line[256];
+    int pid;
+    long long us;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%d %lld", &pid, &us) != 2 || !local_node(pid)) continue;
+        BenchRun *b = &bench_runs[pid - first_pid];
+        b->trace = realloc(b->trace, (b->ntrace + 1) * sizeof(long long));
+        b->trace[b->ntrace++] = us;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Wait for the arrival of the next Lock of `n`; returns its time (us). */
+static long long bench_arrival(Node *n) {
+    BenchRun *b = &bench_runs[n->pid - first_pid];
+    long long at;
+    if (bench_arrivals) {
+        if (b->len >= b->ntrace) return now_us(); /* trace over: closed loop */
+        at = b->start + b->trace[b->len];
+    } else if (bench_rate > 0) {
+        if (!b->next) b->next = b->start + (long long)bench_exp(b, 1e6 / bench_rate);
+        at = b->next;
+        b->next += (long long)bench_exp(b, 1e6 / bench_rate);
+    } else {
+        if (bench_think_us > 0) usleep((useconds_t)bench_exp(b, (double)bench_think_us));
+        return now_us();
+    }
+    long long now = now_us();
+    if (at > now) usleep((useconds_t)(at - now));
+    return at;
+}
+
+static void bench_report(Node *n) {
+    BenchRun *b = &bench_runs[n->pid - first_pid];
+    flockfile(stdout);
+    printf("[proc %d] bench %zu %lld ", n->pid, b->len, now_us() - b->start);
+    for (size_t i = 0; i < b->len; ++i) printf(i ? ",%lld" : "%lld", b->lat[i]);
+    putchar('\n');
+    if (bench_counters) {
+        long long v[NCTR];
+        for (int i = 0; i < NCTR; ++i) v[i] = b->ctr.pos[i] >= 0 ? b->sum[i] : -1;
+        counters_print(n->pid, "grant", (long long)b->len, v, b->ctr.user_only);
+    }
     fflush(stdout);
+    funlockfile(stdout);
+}
+
+/* Critical section worker (--critical-worker): one `./critical --serve` per
+   process, started on first use, runs every critical section: it gets
+   "<pid> <duration> <token>" on a pipe and answers "done" once the section is
+   over. A grant then costs a pipe round trip instead of a shell and an exec.
+   The lock is held by one hosted pid at a time, so they share the worker; if
+   it dies, the remaining sections fall back to system(). */
+static pthread_mutex_t worker_m = PTHREAD_MUTEX_INITIALIZER;
+static int worker_in = -1;   /* its stdin */
+static FILE *worker_out;     /* its stdout */
+static pid_t worker_pid = -1;
+
+/* Start the worker; worker_m held. Returns 0 on success. */
+static int worker_start(void) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0) return -1;
+    if (pipe2(out, O_CLOEXEC) != 0) { close(in[0]); close(in[1]); return -1; }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        execl("./critical", "./critical", "--serve", (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) { close(in[1]); close(out[0]); return -1; }
+    worker_in = in[1];
+    worker_out = fdopen(out[0], "r");
+    worker_pid = pid;
+    return 0;
+}
+
+/* Stop a worker that failed; worker_m held. */
+static void worker_stop(void) {
+    close(worker_in);
+    fclose(worker_out);
+    kill(worker_pid, SIGKILL);
+    waitpid(worker_pid, NULL, 0);
+    worker_in = -1;
+    critical_worker = 0;
+    fprintf(stderr, "critical worker failed, running ./critical per lock\n");
+}
+
+/* Run the critical section of pid `n` through the worker; -1 if it cannot.
+   SIGPIPE is ignored with --critical-worker, so a dead worker fails the write. */
+static int worker_run(Node *n, long long token, int duration) {
+    int rc = -1;
+    pthread_mutex_lock(&worker_m);
+    if (critical_worker && (worker_in >= 0 || worker_start() == 0)) {
+        char cmd[64], reply[16];
+        int len = snprintf(cmd, sizeof(cmd), "%d %d %lld\n", n->pid, duration, token);
+        ssize_t w;
+        while ((w = write(worker_in, cmd, len)) < 0 && errno == EINTR)
+            ;
+        if (w == len && fgets(reply, sizeof(reply), worker_out) &&
+            strcmp(reply, "done\n") == 0)
+            rc = 0;
+        else
+            worker_stop();
+    }
+    pthread_mutex_unlock(&worker_m);
+    return rc;
+}
+
+/* Starting ./critical per lock (--spawn): `system` goes through /bin/sh -c
+   with a command string, `posix_spawn` starts ./critical directly with its
+   argv and LOCK_FENCING_TOKEN in its environment, and `zygote` asks a helper
+   forked at startup, before any thread exists, to posix_spawn it from its
+   small address space and report back over a pipe. Each returns once
+   ./critical has exited. */
+extern char **environ;
+
+/* posix_spawn ./critical for `pid`; returns its wait status, or -1. */
+static int spawn_critical(int pid, int duration, long long token) {
+    char pid_s[16], dur_s[16], token_s[48];
+    snprintf(pid_s, sizeof(pid_s), "%d", pid);
+    snprintf(dur_s, sizeof(dur_s), "%d", duration);
+    snprintf(token_s, sizeof(token_s), "LOCK_FENCING_TOKEN=%lld", token);
+    char *argv[] = { "./critical", pid_s, dur_s, NULL };
+    size_t n_env = 0;
+    while (environ[n_env]) n_env++;
+    char **envp = malloc((n_env + 2) * sizeof(char *));
+    size_t k = 0;
+    for (size_t i = 0; i < n_env; ++i)
+        if (strncmp(environ[i], "LOCK_FENCING_TOKEN=", 19) != 0) envp[k++] = environ[i];
+    envp[k++] = token_s;
+    envp[k] = NULL;
+    pid_t child;
+    int st = posix_spawn(&child, "./critical", NULL, NULL, argv, envp);
+    free(envp);
+    if (st != 0) return -1;
+    while (waitpid(child, &st, 0) < 0)
+        if (errno != EINTR) return -1;
+    return st;
+}
+
+static int zygote_in = -1; /* requests to the zygote */
+static FILE *zygote_out;   /* its replies */
+static pthread_mutex_t zygote_m = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fork the zygote; call while the process has a single thread. */
+static int zygote_start(void) {
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        /* zygote: "<pid> <duration> <token>" in, "<wait status>" out */
+        close(in[1]);
+        close(out[0]);
+        fcntl(in[0], F_SETFD, FD_CLOEXEC);
+        fcntl(out[1], F_SETFD, FD_CLOEXEC);
+        FILE *req = fdopen(in[0], "r");
+        char line[128];
+        int p, d;
+        long long t;
+        while (fgets(line, sizeof(line), req)) {
+            int st = sscanf(line, "%d %d %lld", &p, &d, &t) == 3 ? spawn_critical(p, d, t) : -1;
+            int len = snprintf(line, sizeof(line), "%d\n", st);
+            if (write(out[1], line, len) != len) break;
+        }
+        _exit(0);
+    }
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    zygote_in = in[1];
+    zygote_out = fdopen(out[0], "r");
+    return 0;
+}
+
+/* Run ./critical through the zygote; returns its wait status, or -1. */
+static int zygote_run(int pid, int duration, long long token) {
+    char line[64];
+    int st = -1;
+    pthread_mutex_lock(&zygote_m);
+    int len = snprintf(line, sizeof(line), "%d %d %lld\n", pid, duration, token);
+    if (zygote_in >= 0 && write(zygote_in, line, len) == len && fgets(line, sizeof(line), zygote_out))
+        st = atoi(line);
+    pthread_mutex_unlock(&zygote_m);
+    return st;
+}
+
+/* Run ./critical once for pid `n` as --spawn says. */
+static void run_critical(Node *n, long long token, int duration) {
+    if (spawn_mode == SPAWN_ZYGOTE && zygote_run(n->pid, duration, token) >= 0) return;
+    if (spawn_mode == SPAWN_POSIX && spawn_critical(n->pid, duration, token) >= 0) return;
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "LOCK_FENCING_TOKEN=%lld ./critical %d %d", token, n->pid, duration);
     int rc = system(cmd);
     (void)rc;
+}
+
+/* Take the lock and run the critical section of a Lock instruction.
+   Returns 0, or -1 if the lease expired before the holder released. */
+static int do_request(Node *n, int duration) {
+    int lease = 0;
+    if (lease_ms > 0) lease = (bench ? duration / 1000 : duration * 1000) + lease_ms;
+    long long asked = bench ? bench_arrival(n) : now_us();
+    if (bench) bench_mark(n);
+    long long token = lock_acquire(n, lease);
+
+    if (bench) {
+        bench_count(n);
+        BenchRun *b = &bench_runs[n->pid - first_pid];
+        if (b->len == b->cap) {
+            b->cap = b->cap ? b->cap * 2 : 64;
+            b->lat = realloc(b->lat, b->cap * sizeof(long long));
+        }
+        b->lat[b->len++] = now_us() - asked;
+        if (duration > 0) usleep(duration);
+    } else {
+        /* Granted: call critical (existing binary) exactly as required */
+        printf("[proc %d] entering critical (duration=%d)\n", n->pid, duration);
+        fflush(stdout);
+        if (worker_run(n, token, duration) != 0) run_critical(n, token, duration);
+    }
 
     /* Release */
-    queue_remove(my_req_lc, my_pid);
-    int rel_l = inc_lc();
-    snprintf(msg, sizeof(msg), "REL %d %d %d\n", rel_l, my_req_lc, my_pid);
-    broadcast_short(msg);
-    inc_release_seen(my_pid);
+    rec(n, "L release");
+    if (bench) bench_mark(n);
+    int expired = node_release(n) != 0;
+    if (bench) bench_count(n);
+    if (expired) {
+        printf("[proc %d] lease expired while holding the lock (token %lld)\n", n->pid, token);
+        fflush(stdout);
+        return -1;
+    }
     return 0;
 }
 
-/* Simple wait: block until `other_pid` has produced another release. */
-static void do_wait(int other_pid) {
-    int seen = get_release_seen(other_pid);
+/* Hosted nodes whose instructions are over: they stand in for a process that
+   exited, which a peer in Wait would otherwise only notice through suspicion. */
+static int *node_done;
+static pthread_mutex_t done_m = PTHREAD_MUTEX_INITIALIZER;
+
+static int local_done(int pid) {
+    if (!local_node(pid)) return 0;
+    pthread_mutex_lock(&done_m);
+    int d = node_done[pid - first_pid];
+    pthread_mutex_unlock(&done_m);
+    return d;
+}
+static void set_local_done(Node *n) {
+    pthread_mutex_lock(&done_m);
+    node_done[n->pid - first_pid] = 1;
+    pthread_mutex_unlock(&done_m);
+    for (int k = 0; k < nlocal; ++k) node_changed(&nodes[k]);
+}
+
+/* Simple wait: block until `other_pid` has produced another release (or left/died). */
+static void do_wait(Node *n, int other_pid) {
+    int seen = get_release_seen(n, other_pid);
     while (1) {
-        usleep(100000);
-        int now = get_release_seen(other_pid);
-        if (now > seen) break;
+        unsigned g = wake_gen(n);
+        if (get_release_seen(n, other_pid) > seen) break;
+        if (is_excluded(n, other_pid) || local_done(other_pid)) break;
+        wake_wait(n, g);
     }
 }
 
-/* Execute the instruction list from `filename` for this process id. */
-static void run_instructions(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) { perror("open input"); exit(1); }
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t r;
-    /* skip first line */
-    r = getline(&line, &len, f);
-    (void)r;
-    while ((r = getline(&line, &len, f)) != -1) {
-        if (r <= 1) continue;
-        int target; char cmd[64]; int arg;
-        int parsed = sscanf(line, "%d %63s %d", &target, cmd, &arg);
-        if (parsed < 2) continue;
-        if (target != my_pid) continue;
-        if (strcmp(cmd, "Lock") == 0) {
-            int dur = (parsed >= 3) ? arg : 1;
-            do_request(dur);
-        } else if (strcmp(cmd, "Wait") == 0) {
-            int other = (parsed >= 3) ? arg : 0;
-            do_wait(other);
+/* Join a running mesh, using pids [0, n_initial-1] as the first contacts.
+   Contacts that do not answer within the suspicion timeout are sent JOIN
+   again, up to JOIN_ATTEMPTS times in all; a member that never answers
+   would leave its request and releases unknown, so the join then fails
+   and the process exits. */
+#define JOIN_ATTEMPTS 3
+static void do_join(Node *n, int n_initial) {
+    rec(n, "L join %d", n_initial);
+    node_join_start(n, n_initial);
+    for (int attempt = 1; node_join_pending(n) > 0; ++attempt) {
+        long long give_up = now_ms() + (suspect_ms > 0 ? suspect_ms : SUSPECT_MS);
+        while (node_join_pending(n) > 0 && now_ms() < give_up) {
+            unsigned g = wake_gen(n);
+            if (node_join_pending(n) <= 0) break;
+            wake_wait(n, g);
         }
+        if (node_join_pending(n) <= 0) break;
+        if (attempt == JOIN_ATTEMPTS) {
+            int missing[MAX_PEERS], count = node_join_missing(n, missing);
+            fprintf(stderr, "[proc %d] join failed: no WELCOME from", n->pid);
+            for (int i = 0; i < count; ++i) fprintf(stderr, "%s proc %d", i ? "," : "", missing[i]);
+            fprintf(stderr, "\n");
+            exit(1);
+        }
+        node_join_retry(n);
     }
-    free(line);
-    fclose(f);
+    printf("[proc %d] joined the mesh\n", n->pid);
+    fflush(stdout);
 }
 
-/* Return the total number of releases observed across peers. */
-static int total_releases_seen(void) {
-    int s = 0;
-    pthread_mutex_lock(&rel_m);
-    for (int i = 0; i < N; ++i) s += releases_seen[i];
-    pthread_mutex_unlock(&rel_m);
-    return s;
+/* Daemon mode: local clients talk to us over a Unix socket using the fixed-size
+   binary protocol of lockd.h. Each client connection is served by its own
+   thread, and a lock still held when its client disconnects is released.
+
+   Clients queue on a local ticket lock (a cohort): only the client at its
+   head takes part in the distributed protocol. When a client unlocks while
+   others are queued, the distributed grant is handed to the next one
+   directly, up to --cohort holders per grant, before it is released to the
+   mesh; one REQ/ACK/REL round then serves several local acquisitions. The
+   holders of one grant share its fencing token. Leases cover one holder,
+   so handing over is disabled with --lease-ms. */
+static int cohort_max = 1; /* local holders per distributed grant */
+
+static struct {
+    pthread_mutex_t m;
+    pthread_cond_t cv;
+    unsigned long long next_ticket, serving;
+    int queued;       /* clients with a ticket not served yet */
+    int held;         /* the node holds the distributed lock */
+    int holders;      /* clients served under the current grant */
+    long long token;
+} cohort = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 0 };
+
+/* Take the lock for a local client; `lease` as for lock_acquire. Returns the token. */
+static long long cohort_lock(Node *n, int lease) {
+    pthread_mutex_lock(&cohort.m);
+    unsigned long long ticket = cohort.next_ticket++;
+    cohort.queued++;
+    while (cohort.serving != ticket) pthread_cond_wait(&cohort.cv, &cohort.m);
+    cohort.queued--;
+    if (cohort.held) {
+        /* handed over by the previous holder */
+        cohort.holders++;
+        long long token = cohort.token;
+        pthread_mutex_unlock(&cohort.m);
+        return token;
+    }
+    pthread_mutex_unlock(&cohort.m);
+    long long token = lock_acquire(n, lease);
+    pthread_mutex_lock(&cohort.m);
+    cohort.held = 1;
+    cohort.holders = 1;
+    cohort.token = token;
+    pthread_mutex_unlock(&cohort.m);
+    return token;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <id> <input_file>\n", argv[0]);
-        return 1;
+/* Unlock for a local client: hand over to the next queued client, or release
+   to the mesh. Returns 0, or -1 if the lease expired before the release. */
+static int cohort_unlock(Node *n) {
+    int rc = 0;
+    pthread_mutex_lock(&cohort.m);
+    if (cohort.queued == 0 || cohort.holders >= cohort_max || lease_ms > 0) {
+        rec(n, "L release");
+        rc = node_release(n);
+        cohort.held = 0;
     }
-    my_pid = atoi(argv[1]);
-    const char *infile = argv[2];
+    cohort.serving++;
+    pthread_cond_broadcast(&cohort.cv);
+    pthread_mutex_unlock(&cohort.m);
+    return rc;
+}
 
-    /* read N */
-    FILE *f = fopen(infile, "r");
-    if (!f) { perror("open"); return 1; }
-    if (fscanf(f, "%d", &N) != 1) { fprintf(stderr, "bad input\n"); return 1; }
-    fclose(f);
-    /* Count total number of Lock instructions in the input file (for termination) */
-    {
-        FILE *ff = fopen(infile, "r");
-        if (ff) {
-            char *line = NULL; size_t len = 0; ssize_t r;
-            /* skip first line with N */
-            r = getline(&line, &len, ff);
-            (void)r;
-            while ((r = getline(&line, &len, ff)) != -1) {
-                if (r <= 1) continue;
-                int target; char cmd[64]; int arg;
-                int parsed = sscanf(line, "%d %63s %d", &target, cmd, &arg);
-                if (parsed >= 2 && strcmp(cmd, "Lock") == 0) total_locks++;
-            }
-            free(line);
-            fclose(ff);
+/* Read exactly `len` bytes; returns 0 on success, -1 on EOF/error. */
+static int read_all(int s, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(s, (char *)buf + got, len - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return 0;
+}
+
+/* Serve one client connection until it closes. */
+static void *client_thread(void *arg) {
+    int c = *(int*)arg;
+    free(arg);
+    Node *n = &nodes[0];
+    int holding = 0;
+    unsigned char req[LOCKD_REQ_SIZE], resp[LOCKD_RESP_SIZE];
+    while (read_all(c, req, sizeof(req)) == 0) {
+        int op, a;
+        lockd_decode_req(req, &op, &a);
+        int status = LOCKD_OK;
+        long long token = 0;
+        if (op == LOCKD_OP_LOCK && !holding) {
+            /* `a` is the expected hold time in ms; the lease adds --lease-ms slack */
+            token = cohort_lock(n, lease_ms > 0 ? (a > 0 ? a : 0) + lease_ms : 0);
+            holding = 1;
+        } else if (op == LOCKD_OP_UNLOCK && holding) {
+            if (cohort_unlock(n) != 0) status = LOCKD_LOST;
+            holding = 0;
+        } else if (op == LOCKD_OP_WAIT && a >= 0 && a < MAX_PEERS) {
+            do_wait(n, a);
+        } else {
+            status = LOCKD_EINVAL;
         }
+        lockd_encode_resp(resp, status, token);
+        if (write_all(c, (const char *)resp, sizeof(resp)) != 0) break;
     }
-    if (N <= 0 || N > MAX_PEERS) { fprintf(stderr, "bad N\n"); return 1; }
+    if (holding) cohort_unlock(n);
+    close(c);
+    return NULL;
+}
 
-    /* init release counters */
-    for (int i = 0; i < MAX_PEERS; ++i) {
-        releases_seen[i] = 0;
+/* Accept loop of the client socket. */
+static void *daemon_thread(void *arg) {
+    int srv = *(int*)arg;
+    while (1) {
+        int c = accept(srv, NULL, NULL);
+        if (c < 0) continue;
+        int *p = malloc(sizeof(int));
+        *p = c;
+        pthread_t t;
+        pthread_create(&t, NULL, client_thread, p);
+        pthread_detach(t);
     }
+    return NULL;
+}
 
-    pthread_t srv;
-    if (pthread_create(&srv, NULL, server_thread, NULL) != 0) {
-        perror("pthread_create server");
+/* Serve clients on `path` until SIGINT/SIGTERM, then leave the mesh.
+   The signals must already be blocked in every thread. */
+static int run_daemon(const char *path) {
+    static int srv;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "socket path too long\n"); return 1; }
+    strcpy(addr.sun_path, path);
+    srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (srv < 0 || bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(srv, 64) < 0) {
+        perror("daemon socket");
+        return 1;
+    }
+    pthread_t t;
+    if (pthread_create(&t, NULL, daemon_thread, &srv) != 0) {
+        perror("pthread_create daemon");
         return 1;
     }
+    printf("[proc %d] serving clients on %s\n", nodes[0].pid, path);
+    fflush(stdout);
 
-    usleep(200000); /* small delay to let servers bind */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    int sig;
+    sigwait(&set, &sig);
+    unlink(path);
+    rec(&nodes[0], "L leave");
+    node_leave(&nodes[0]);
+    usleep(200000);
+    return 0;
+}
 
-    pthread_t con;
-    if (pthread_create(&con, NULL, connector_thread, NULL) != 0) {
-        perror("pthread_create connector");
-        return 1;
+/* Execute the instructions of node `n`.
+   Returns 1 if a Leave instruction took it out of the mesh. */
+static int run_instructions(Node *n) {
+    Cursor c;
+    const ScriptOp *op;
+    cursor_init(&c, &script.prog[n->pid]);
+    while ((op = cursor_next(&c))) {
+        if (op->op == SOP_LOCK) {
+            do_request(n, (int)op->arg);
+        } else if (op->op == SOP_WAIT) {
+            do_wait(n, (int)op->arg);
+        } else if (op->op == SOP_LEAVE) {
+            rec(n, "L leave");
+            node_leave(n);
+            return 1;
+        }
     }
+    return 0;
+}
+
+/* Return true once every member known to `n` has released all of its Lock
+   instructions (peers that left or are suspected dead are not waited for). */
+static int all_releases_seen(Node *n) {
+    for (int i = 0; i < N; ++i) {
+        if (get_release_seen(n, i) < locks_per_pid[i] && is_member(n, i)) return 0;
+    }
+    return 1;
+}
+
+/* Instruction thread of one hosted node: join if asked, run the script, then
+   wait for global termination. */
+typedef struct NodeRun {
+    Node *n;
+    int n_initial;
+} NodeRun;
 
-    /* Run instructions (blocks until finished) */
-    run_instructions(infile);
+static void *node_thread(void *arg) {
+    NodeRun *run = arg;
+    Node *n = run->n;
+    if (join_mode) do_join(n, run->n_initial);
+
+    /* Run instructions (blocks until finished); after a Leave nobody waits for us */
+    if (bench && bench_counters) counters_open(&bench_runs[n->pid - first_pid].ctr);
+    if (bench) bench_runs[n->pid - first_pid].start = now_us();
+    int left = run_instructions(n);
+    if (bench) bench_report(n);
+    set_local_done(n);
+    if (left) return NULL;
 
     /* Wait for global termination: all Lock instructions have produced a Release
        message which every process should observe. This prevents processes that
        finished their own instructions from exiting early and therefore not
-       replying to future REQ messages from peers. */
-    while (total_releases_seen() < total_locks) {
-        usleep(100000);
+       replying to future REQ messages from peers. Peers that left or are
+       suspected dead are discounted so a crash cannot stall the survivors forever. */
+    while (1) {
+        unsigned g = wake_gen(n);
+        if (all_releases_seen(n)) break;
+        wake_wait(n, g);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <id> <input_file>\n"
+            "  --heartbeat-ms <ms>  interval between heartbeats (default %d)\n"
+            "  --suspect-ms <ms>    silence before a peer is suspected, 0 disables (default %d)\n"
+            "  --lease-ms <ms>      lease slack beyond each Lock duration, 0 disables (default 0)\n"
+            "  --join               join a running mesh (id may exceed the initial N)\n"
+            "  --daemon <path>      serve lock clients on a Unix socket instead of running the script\n"
+            "  --vnodes <k>         host pids [id, id+k) in this process (id must be a multiple of k)\n"
+            "  --config <file>      endpoints of every pid (host:port, [ipv6]:port, unix:path)\n"
+            "  --base-port <port>   without --config, pid i listens on port+i (default %d)\n"
+            "  --relay              send one copy of each broadcast per process and combine replies\n"
+            "  --cohort <k>         daemon: hand the lock to up to k queued clients per grant (default 1)\n"
+            "  --metrics <addr>     serve Prometheus metrics on a port, host:port or unix:path\n"
+            "  --admin <path>       dump the queue, ACKs and connections to clients of this Unix socket\n"
+            "  --record <prefix>    log what each hosted pid handles to <prefix>.<pid>, for ./replay\n"
+            "  --bench              hold the lock for Lock durations in us, no ./critical; report latencies\n"
+            "  --rate <r>           bench: open loop, Poisson arrivals of r Locks per second per pid\n"
+            "  --arrivals <file>    bench: open loop, Lock arrival times from \"<pid> <us>\" lines\n"
+            "  --think-us <us>      bench, closed loop: mean exponential think time before each Lock\n"
+            "  --counters           bench: report cycles, instructions, cache misses, context switches, CPU time per lock\n"
+            "  --critical-worker    run critical sections in one persistent `./critical --serve`\n"
+            "  --spawn <how>        start ./critical per lock with system, posix_spawn or zygote (default system)\n"
+            "  --log-dir <dir>      ./critical logs each pid to <dir>/log.<pid>.txt (see merge_logs.pl)\n"
+            "  --emu-delay-us <us>  emulated one-way delay of every link (enables emulation)\n"
+            "  --emu-jitter-us <us> emulated extra delay, uniform in [0, us]\n"
+            "  --emu-bandwidth-mbps <m>  emulated bandwidth towards each peer process\n"
+            "  --emu-reorder <pct>  percentage of messages that may overtake their link\n"
+            "  --emu-link <a>-<b>:<us>  delay of the link between pids a and b (repeatable)\n"
+            "  --emu-seed <s>       seed of the emulated jitter and reordering (default 1)\n",
+            prog, HEARTBEAT_MS, SUSPECT_MS, BASE_PORT);
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        {"heartbeat-ms", required_argument, NULL, 'h'},
+        {"suspect-ms", required_argument, NULL, 's'},
+        {"lease-ms", required_argument, NULL, 'l'},
+        {"join", no_argument, NULL, 'j'},
+        {"daemon", required_argument, NULL, 'd'},
+        {"vnodes", required_argument, NULL, 'k'},
+        {"emu-delay-us", required_argument, NULL, 'D'},
+        {"emu-jitter-us", required_argument, NULL, 'J'},
+        {"emu-bandwidth-mbps", required_argument, NULL, 'B'},
+        {"emu-reorder", required_argument, NULL, 'R'},
+        {"emu-link", required_argument, NULL, 'E'},
+        {"emu-seed", required_argument, NULL, 'S'},
+        {"config", required_argument, NULL, 'C'},
+        {"base-port", required_argument, NULL, 'P'},
+        {"relay", no_argument, NULL, 'r'},
+        {"cohort", required_argument, NULL, 'c'},
+        {"metrics", required_argument, NULL, 'm'},
+        {"admin", required_argument, NULL, 'a'},
+        {"record", required_argument, NULL, 'e'},
+        {"bench", no_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'q'},
+        {"arrivals", required_argument, NULL, 'A'},
+        {"think-us", required_argument, NULL, 't'},
+        {"counters", no_argument, NULL, 'H'},
+        {"critical-worker", no_argument, NULL, 'w'},
+        {"spawn", required_argument, NULL, 'x'},
+        {"log-dir", required_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h': heartbeat_ms = atoi(optarg); break;
+        case 's': suspect_ms = atoi(optarg); break;
+        case 'l': lease_ms = atoi(optarg); break;
+        case 'j': join_mode = 1; break;
+        case 'd': daemon_sock = optarg; break;
+        case 'k': vnodes = atoi(optarg); break;
+        case 'D': emu_delay_us = atoll(optarg); emu_on = 1; break;
+        case 'J': emu_jitter_us = atoll(optarg); emu_on = 1; break;
+        case 'B': emu_bandwidth_mbps = atof(optarg); emu_on = 1; break;
+        case 'R': emu_reorder = atoi(optarg); emu_on = 1; break;
+        case 'E':
+            if (emu_add_link(optarg) != 0) { usage(argv[0]); return 1; }
+            emu_on = 1;
+            break;
+        case 'S': emu_seed = strtoull(optarg, NULL, 10); break;
+        case 'C': config_file = optarg; break;
+        case 'P': base_port = atoi(optarg); break;
+        case 'r': relay = 1; break;
+        case 'c': cohort_max = atoi(optarg); break;
+        case 'm': metrics_addr = optarg; break;
+        case 'a': admin_sock = optarg; break;
+        case 'e': record_prefix = optarg; break;
+        case 'b': bench = 1; break;
+        case 'q': bench_rate = atof(optarg); break;
+        case 'A': bench_arrivals = optarg; break;
+        case 't': bench_think_us = atoll(optarg); break;
+        case 'H': bench_counters = 1; break;
+        case 'w': critical_worker = 1; break;
+        case 'L':
+            /* read by ./critical: one log file per pid in this directory */
+            mkdir(optarg, 0755);
+            setenv("LOCK_LOG_DIR", optarg, 1);
+            break;
+        case 'x':
+            if (strcmp(optarg, "system") == 0) spawn_mode = SPAWN_SYSTEM;
+            else if (strcmp(optarg, "posix_spawn") == 0) spawn_mode = SPAWN_POSIX;
+            else if (strcmp(optarg, "zygote") == 0) spawn_mode = SPAWN_ZYGOTE;
+            else { usage(argv[0]); return 1; }
+            break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || heartbeat_ms <= 0 || suspect_ms < 0 || lease_ms < 0 ||
+        vnodes <= 0 || vnodes > MAX_PEERS || (config_file && vnodes != 1) || cohort_max <= 0 ||
+        base_port <= 0 || base_port + MAX_PEERS > 65536 ||
+        emu_delay_us < 0 || emu_jitter_us < 0 || emu_bandwidth_mbps < 0 || emu_reorder < 0 || emu_reorder > 100 ||
+        bench_rate < 0 || bench_think_us < 0 || ((bench_rate > 0 || bench_arrivals || bench_think_us || bench_counters) && !bench) ||
+        (bench_rate > 0 && bench_arrivals)) {
+        usage(argv[0]);
+        return 1;
+    }
+    first_pid = atoi(argv[optind]);
+    const char *infile = argv[optind + 1];
+
+    /* read the instructions, and count the Lock instructions (for termination) */
+    if (script_load(infile, &script) != 0) return 1;
+    int n_initial = script.n;
+    for (int i = 0; i < MAX_PEERS; ++i) locks_per_pid[i] = program_locks(&script.prog[i]);
+    if (config_file && load_config(config_file) != 0) return 1;
+    if (first_pid < 0 || first_pid >= (join_mode ? MAX_PEERS : n_initial) || host_of(first_pid) != first_pid ||
+        (config_file && !configured[first_pid])) {
+        fprintf(stderr, "bad id\n");
+        return 1;
+    }
+    /* the initial membership is [0, N-1]; a joiner learns it from the mesh */
+    nlocal = 0;
+    while (first_pid + nlocal < MAX_PEERS && host_of(first_pid + nlocal) == first_pid &&
+           (config_file || nlocal < vnodes))
+        nlocal++;
+    if (!join_mode && first_pid + nlocal > n_initial) nlocal = n_initial - first_pid;
+    if (daemon_sock && nlocal != 1) {
+        fprintf(stderr, "--daemon hosts a single pid\n");
+        return 1;
+    }
+    N = n_initial;
+
+    if (daemon_sock) {
+        /* handled by sigwait in run_daemon; block before any thread starts */
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+
+    /* init connections; every peer gets a full timeout to show up */
+    long long start = now_ms();
+    for (int i = 0; i < MAX_PEERS; ++i) {
+        last_heard[i] = start;
+        host_fd[i] = -1;
+        host_ids[i] = i;
+        pthread_mutex_init(&host_m[i], NULL);
+    }
+    nodes = calloc(nlocal, sizeof(Node));
+    wakes = calloc(nlocal, sizeof(Wake));
+    node_done = calloc(nlocal, sizeof(int));
+    node_metrics = calloc(nlocal, sizeof(NodeMetrics));
+    bench_runs = calloc(nlocal, sizeof(BenchRun));
+    for (int k = 0; k < nlocal; ++k) bench_runs[k].rng = 0x9E3779B97F4A7C15ULL * (unsigned long long)(first_pid + k + 1);
+    if (bench_arrivals && bench_load_arrivals(bench_arrivals) != 0) return 1;
+    for (int k = 0; k < nlocal; ++k)
+        for (int i = 0; i < MAX_PEERS; ++i) node_metrics[k].peer_lc[i] = -1;
+    if (record_prefix && rec_open(record_prefix) != 0) return 1;
+    if (spawn_mode == SPAWN_ZYGOTE && !bench && zygote_start() != 0) {
+        perror("zygote");
+        return 1;
+    }
+    if (critical_worker || spawn_mode == SPAWN_ZYGOTE) signal(SIGPIPE, SIG_IGN);
+    for (int k = 0; k < nlocal; ++k) {
+        pthread_mutex_init(&wakes[k].m, NULL);
+        pthread_cond_init(&wakes[k].cv, NULL);
+        node_init(&nodes[k], first_pid + k, relay ? &relay_ops : &node_ops, &wakes[k]);
+        if (!join_mode) {
+            for (int i = 0; i < n_initial; ++i) {
+                rec(&nodes[k], "L member %d", i);
+                add_member(&nodes[k], i);
+            }
+        }
+    }
+    if (join_mode) {
+        /* hosted nodes know each other from the start */
+        for (int k = 0; k < nlocal; ++k)
+            for (int j = 0; j < nlocal; ++j) {
+                rec(&nodes[k], "L member %d", first_pid + j);
+                add_member(&nodes[k], first_pid + j);
+            }
+    }
+
+    inbox_fd = eventfd(0, 0);
+    loop_ep = epoll_create1(EPOLL_CLOEXEC);
+    if (metrics_addr && start_metrics(metrics_addr) != 0) return 1;
+    if (admin_sock && start_admin(admin_sock) != 0) return 1;
+    if (emu_on && emu_start() != 0) {
+        perror("pthread_create emulation");
+        return 1;
+    }
+    open_server();
+    pthread_t loop;
+    if (pthread_create(&loop, NULL, event_loop, NULL) != 0) {
+        perror("pthread_create event loop");
+        return 1;
+    }
+
+    usleep(200000); /* small delay to let servers bind */
+
+    if (!join_mode) {
+        pthread_t con;
+        if (pthread_create(&con, NULL, connector_thread, NULL) != 0) {
+            perror("pthread_create connector");
+            return 1;
+        }
+    }
+
+    if (suspect_ms > 0 || lease_ms > 0) {
+        pthread_t mon;
+        if (pthread_create(&mon, NULL, monitor_thread, NULL) != 0) {
+            perror("pthread_create monitor");
+            return 1;
+        }
+    }
+
+    /* A daemon runs until it is told to stop and never executes the script */
+    if (daemon_sock) {
+        if (join_mode) do_join(&nodes[0], n_initial);
+        return run_daemon(daemon_sock);
+    }
+
+    NodeRun *runs = calloc(nlocal, sizeof(NodeRun));
+    pthread_t *threads = calloc(nlocal, sizeof(pthread_t));
+    for (int k = 0; k < nlocal; ++k) {
+        runs[k].n = &nodes[k];
+        runs[k].n_initial = n_initial;
+        if (pthread_create(&threads[k], NULL, node_thread, &runs[k]) != 0) {
+            perror("pthread_create node");
+            return 1;
+        }
+    }
+    for (int k = 0; k < nlocal; ++k) pthread_join(threads[k], NULL);
+    if (bench && bench_counters) {
+        /* message handling of this process, over all the locks of the run */
+        long long v[NCTR], locks = 0;
+        for (int i = 0; i < MAX_PEERS; ++i) locks += locks_per_pid[i];
+        counters_read(&loop_counters, v);
+        counters_print(first_pid, "loop", locks, v, loop_counters.user_only);
     }
 
     /* allow a brief moment for last messages to settle, then exit */
     usleep(200000);
-    printf("[proc %d] finished, exiting\n", my_pid);
+    for (int k = 0; k < nlocal; ++k) printf("[proc %d] finished, exiting\n", nodes[k].pid);
     fflush(stdout);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lamport.h"
+
+/* Replay of a recording made with `./process --record <prefix>`: one node
+   gets the messages and operations of <prefix>.<pid> again, in the recorded
+   order and at the recorded (virtual) times, in one thread and without any
+   socket. Messages it sends are counted and dropped. Each call into the
+   protocol logic is timed, so a slow run can be profiled again and again. */
+
+static int repeat = 1;
+
+static long long vnow = 0; /* recorded time of the current entry, us */
+
+/* One recorded line: a message ("R") or an operation ("L"). */
+typedef struct Entry {
+    long long t;
+    int kind;
+    char *text;
+} Entry;
+static Entry *entries;
+static size_t n_entries = 0, entries_cap = 0;
+static int rec_pid = -1, rec_n = 0;
+
+/* Timings per message type and operation, over all repetitions. */
+#define MAX_KINDS 32
+typedef struct Kind {
+    char name[24];
+    long long *ns;
+    size_t len, cap;
+} Kind;
+static Kind kinds[MAX_KINDS];
+static int n_kinds = 0;
+
+static long long sent = 0;
+
+static long long replay_now_ms(void) {
+    return vnow / 1000;
+}
+static int replay_send(Node *n, int dst, const char *msg) {
+    (void)n; (void)dst; (void)msg;
+    sent++;
+    return 0;
+}
+static const NodeOps replay_ops = { replay_send, NULL, NULL, NULL, replay_now_ms };
+
+static long long wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Timings of the entries named `name` ("REQ", "request", ...). */
+static Kind *kind_of(const char *name) {
+    for (int i = 0; i < n_kinds; ++i)
+        if (strcmp(kinds[i].name, name) == 0) return &kinds[i];
+    if (n_kinds == MAX_KINDS) return &kinds[MAX_KINDS - 1];
+    Kind *k = &kinds[n_kinds++];
+    snprintf(k->name, sizeof(k->name), "%s", name);
+    return k;
+}
+static void add_time(Kind *k, long long ns) {
+    if (k->len == k->cap) {
+        k->cap = k->cap ? k->cap * 2 : 1024;
+        k->ns = realloc(k->ns, k->cap * sizeof(long long));
+    }
+    k->ns[k->len++] = ns;
+}
+
+static int load_recording(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) { perror(filename); return -1; }
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t r;
+    if (getline(&line, &len, f) < 0 || sscanf(line, "# pid %d N %d", &rec_pid, &rec_n) != 2 ||
+        rec_pid < 0 || rec_pid >= MAX_PEERS || rec_n <= 0 || rec_n > MAX_PEERS) {
+        fprintf(stderr, "%s: not a recording\n", filename);
+        fclose(f);
+        return -1;
+    }
+    while ((r = getline(&line, &len, f)) != -1) {
+        if (r > 0 && line[r - 1] == '\n') line[--r] = '\0';
+        long long t;
+        char kind;
+        int off;
+        if (sscanf(line, "%lld %c %n", &t, &kind, &off) < 2 || (kind != 'R' && kind != 'L')) continue;
+        if (n_entries == entries_cap) {
+            entries_cap = entries_cap ? entries_cap * 2 : 1024;
+            entries = realloc(entries, entries_cap * sizeof(Entry));
+        }
+        entries[n_entries].t = t;
+        entries[n_entries].kind = kind;
+        entries[n_entries].text = strdup(line + off);
+        n_entries++;
+    }
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+/* Apply recorded operation `op` to `n`. */
+static void apply_op(Node *n, const char *op) {
+    char name[16];
+    int a = 0, b = 0;
+    if (sscanf(op, "%15s %d %d", name, &a, &b) < 1) return;
+    if (strcmp(name, "member") == 0) add_member(n, a);
+    else if (strcmp(name, "request") == 0) node_request(n, a);
+    else if (strcmp(name, "enter") == 0) node_enter(n);
+    else if (strcmp(name, "cancel") == 0) node_cancel(n);
+    else if (strcmp(name, "release") == 0) node_release(n);
+    else if (strcmp(name, "expire") == 0) node_expire_leases(n);
+    else if (strcmp(name, "suspect") == 0) suspect_peer(n, a, b);
+    else if (strcmp(name, "join") == 0) node_join_start(n, a);
+    else if (strcmp(name, "leave") == 0) node_leave(n);
+}
+
+/* Run the whole recording once on a fresh node; returns its final clock. */
+static int replay_once(Node *n) {
+    N = rec_n;
+    node_init(n, rec_pid, &replay_ops, NULL);
+    n->quiet = 1;
+    for (size_t i = 0; i < n_entries; ++i) {
+        Entry *e = &entries[i];
+        char name[16];
+        if (sscanf(e->text, "%15s", name) != 1) continue;
+        vnow = e->t;
+        long long t0 = wall_ns();
+        if (e->kind == 'R') process_line(n, e->text);
+        else apply_op(n, e->text);
+        long long t1 = wall_ns();
+        add_time(kind_of(name), t1 - t0);
+    }
+    int lc = node_clock(n);
+    free(n->queue);
+    return lc;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <recording>\n"
+            "  --repeat <k>   replay the recording k times (default 1)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        {"repeat", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'r': repeat = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (repeat <= 0 || argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (load_recording(argv[optind]) != 0) return 1;
+
+    Node *n = malloc(sizeof(Node));
+    int lc = -1, diverged = 0;
+    long long w0 = wall_ns();
+    for (int r = 0; r < repeat; ++r) {
+        int l = replay_once(n);
+        if (r > 0 && l != lc) diverged = 1;
+        lc = l;
+    }
+    double wall = (wall_ns() - w0) / 1e9;
+
+    printf("pid            %d\n", rec_pid);
+    printf("entries        %zu (%.3f s recorded)\n", n_entries, n_entries ? entries[n_entries - 1].t / 1e6 : 0.0);
+    printf("final clock    %d\n", lc);
+    printf("messages sent  %lld per replay\n", sent / repeat);
+    printf("wall time      %.3f s for %d replays\n", wall, repeat);
+    printf("%-10s %10s %10s %10s %10s %10s\n", "entry", "count", "mean ns", "p50 ns", "p99 ns", "max ns");
+    for (int i = 0; i < n_kinds; ++i) {
+        Kind *k = &kinds[i];
+        qsort(k->ns, k->len, sizeof(long long), cmp_ll);
+        double sum = 0;
+        for (size_t j = 0; j < k->len; ++j) sum += k->ns[j];
+        printf("%-10s %10zu %10.0f %10lld %10lld %10lld\n", k->name, k->len / repeat, sum / k->len,
+               k->ns[k->len / 2], k->ns[(size_t)(k->len * 0.99)], k->ns[k->len - 1]);
+    }
+    if (diverged) printf("replays diverged: the final clock differs between repetitions\n");
+    return diverged;
+}
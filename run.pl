@@ -1,31 +1,67 @@
 #!/usr/bin/perl
 use strict;
 use warnings;
+use FindBin;
+use lib $FindBin::Bin;
+use LockScript qw(expand);
 
 # Usage: ./run.pl ./test/testXX
 # Spawns multiple `./process <id> <file>` according to the first line of the test file
+# Options for ./process can be given in the PROCESS_ARGS environment variable
+# With LOCK_LOG_DIR set, ./critical logs per pid there and the logs are merged into log.txt
+# With VERIFY_ONLINE set, verify.pl checks log.txt during the run and stops it at the first violation
+# Pids with a Join instruction are started with --join, a second after the others
 
 # Clean log
 `make log_reset`;
+if ($ENV{LOCK_LOG_DIR}) {
+	mkdir($ENV{LOCK_LOG_DIR});
+	unlink glob("$ENV{LOCK_LOG_DIR}/log.*.txt");
+}
 
-# First input line is the number of `./process` to spawn
+# First input line is the number of `./process` to spawn; Repeat blocks and
+# Pid sections are expanded for the checks below
 my $file = $ARGV[0] or die "Usage: $0 <testfile>\n";
-my @input_lines = <>;
-my $num_processes = shift @input_lines;
-chomp($num_processes);
+my ($num_processes, @input_lines) = expand($file);
+my %joining = map { /^(\d+) Join$/ ? ($1 => 1) : () } @input_lines;
 
 # Spawn the processes and wait for them
 my @pids;
-for (my $i = 0; $i < $num_processes; $i++) {
+my @ids = ((grep { !$joining{$_} } 0 .. $num_processes - 1), sort { $a <=> $b } keys %joining);
+my $joined = 0;
+for my $i (@ids) {
+	 sleep(1) if $joining{$i} && !$joined++; # let the mesh come up first
 	 my $pid = fork();
 	 if (!defined $pid) {
 		  die "Fork failed: $!";
 	 } elsif ($pid == 0) {
-		 exec("./process", $i, $file) or die "Exec failed: $!";
+		 exec("./process", split(" ", $ENV{PROCESS_ARGS} // ""), ($joining{$i} ? "--join" : ()), $i, $file)
+			or die "Exec failed: $!";
 		 exit;
 	 }
+	 push @pids, $pid;
+}
+if ($ENV{VERIFY_ONLINE} && !$ENV{LOCK_LOG_DIR}) {
+	my $verify = $0;
+	$verify =~ s{run\.pl$}{verify.pl};
+	my $vpid = fork();
+	die "Fork failed: $!" unless defined $vpid;
+	if ($vpid == 0) {
+		exec("perl", $verify, "--follow", "--watch", join(",", @pids), $file, "log.txt") or die "Exec failed: $!";
+	}
+	while ((my $pid = wait()) >= 0) {
+		next unless $pid == $vpid && $? != 0;
+		kill 'TERM', @pids;
+		1 while wait() >= 0;
+		die "Online verification failed, run stopped\n";
+	}
 }
 1 while wait() >= 0;
+if ($ENV{LOCK_LOG_DIR}) {
+	my $merge = $0;
+	$merge =~ s{run\.pl$}{merge_logs.pl};
+	system("perl", $merge, "-o", "log.txt", $ENV{LOCK_LOG_DIR}) == 0 or die "Could not merge the logs\n";
+}
 
 # Open log.txt and check consistency
 open(my $log_fh, '<', 'log.txt') or die "Could not open log.txt: $!";
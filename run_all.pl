@@ -0,0 +1,103 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Cwd qw(abs_path);
+use File::Basename qw(dirname);
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use POSIX qw(WNOHANG);
+use Time::HiRes qw(time);
+use FindBin;
+use lib $FindBin::Bin;
+use LockScript qw(expand);
+
+# Usage: ./run_all.pl [--jobs <k>] [--base-port <port>] [--split-logs] [--keep] [testfile...]
+# Runs run.pl on every test (default: tests/*) with up to --jobs of them at
+# once (default: all). Each run gets its own directory, holding its log.txt
+# and output, and its own range of ports: the first test listens from
+# --base-port (default 20000, below the usual ephemeral ports) and every
+# following one right after the pids of the previous. Prints pass/fail and
+# the time of every test; the output of failed runs is kept (all with --keep).
+# With --split-logs, ./critical logs per pid and run.pl merges the logs.
+
+my $jobs = 0;
+my $base_port = 20000;
+my $keep = 0;
+my $split_logs = 0;
+GetOptions("jobs=i" => \$jobs, "base-port=i" => \$base_port, "split-logs" => \$split_logs, "keep" => \$keep)
+	or die "Usage: $0 [--jobs k] [--base-port port] [--split-logs] [--keep] [testfile...]\n";
+
+my $root = dirname(abs_path($0));
+my @tests = @ARGV ? @ARGV : sort glob("$root/tests/*");
+die "No tests\n" unless @tests;
+$jobs = @tests if $jobs <= 0;
+my $top = tempdir("run_all.XXXXXX", TMPDIR => 1);
+
+# Prepare one directory per test, with the binaries linked in
+my (@runs, $port);
+$port = $base_port;
+for my $test (@tests) {
+	# ports for pids [0, N-1] and the pids that join
+	my ($n, @lines) = expand($test);
+	for (@lines) { $n = $1 + 1 if /^(\d+) / && $1 >= $n; }
+	(my $name = $test) =~ s{.*/}{};
+	my $dir = "$top/$name";
+	mkdir($dir) or die "$dir: $!";
+	symlink("$root/$_", "$dir/$_") or die "$dir/$_: $!" for ("process", "critical", "Makefile");
+	push @runs, { test => abs_path($test), name => $name, dir => $dir, port => $port };
+	$port += $n;
+	die "Not enough ports above $base_port for all tests\n" if $port > 65535;
+}
+
+# Run them, at most $jobs at a time
+my %running;
+my $next = 0;
+my $start = time();
+while ($next < @runs || %running) {
+	while ($next < @runs && keys(%running) < $jobs) {
+		my $run = $runs[$next++];
+		$run->{start} = time();
+		my $pid = fork();
+		die "Fork failed: $!" unless defined $pid;
+		if ($pid == 0) {
+			chdir($run->{dir}) or die "$run->{dir}: $!";
+			open(STDOUT, '>', "output") or die "output: $!";
+			open(STDERR, '>&', \*STDOUT);
+			$ENV{PROCESS_ARGS} = "--base-port $run->{port}";
+			$ENV{LOCK_LOG_DIR} = "$run->{dir}/logs" if $split_logs;
+			exec("perl", "$root/run.pl", $run->{test}) or die "Exec failed: $!";
+		}
+		$running{$pid} = $run;
+	}
+	my $pid = waitpid(-1, 0);
+	last if $pid < 0;
+	my $run = delete $running{$pid} or next;
+	$run->{status} = $?;
+	$run->{seconds} = time() - $run->{start};
+}
+my $wall = time() - $start;
+
+# Report
+my ($failed, $sum) = (0, 0);
+for my $run (@runs) {
+	my $ok = $run->{status} == 0;
+	$failed++ unless $ok;
+	$sum += $run->{seconds};
+	printf "%-12s %-4s %7.2f s\n", $run->{name}, $ok ? "ok" : "FAIL", $run->{seconds};
+	if (!$ok) {
+		open(my $fh, '<', "$run->{dir}/output");
+		my @lines = $fh ? <$fh> : ();
+		print "    $_" for @lines[($#lines > 9 ? $#lines - 9 : 0) .. $#lines];
+		print "    (output in $run->{dir})\n";
+	}
+}
+printf "%d/%d passed in %.2f s (%.2f s of test time)\n", @runs - $failed, scalar(@runs), $wall, $sum;
+if ($keep || $failed) {
+	for my $run (@runs) {
+		next if $keep || $run->{status} != 0;
+		system("rm", "-rf", $run->{dir});
+	}
+} else {
+	system("rm", "-rf", $top);
+}
+exit($failed ? 1 : 0);
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "script.h"
+
+void program_add(Program *p, int op, long long arg, int len) {
+    if (p->len == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 8;
+        p->ops = realloc(p->ops, p->cap * sizeof(ScriptOp));
+    }
+    p->ops[p->len].op = op;
+    p->ops[p->len].arg = arg;
+    p->ops[p->len].len = len;
+    p->len++;
+}
+
+/* Parser state; a block may span lines. */
+typedef struct Parser {
+    Script *s;
+    const char *file;
+    int line;
+    int *sect;       /* pids of the last Pid line */
+    int n_sect;
+    int line_pid;    /* pid the current statement starts with, -1 = the section */
+    Program cur;     /* statement being parsed */
+    int open[SCRIPT_DEPTH]; /* positions of the open Repeats in cur */
+    int depth;
+} Parser;
+
+static int fail(Parser *ps, const char *what) {
+    fprintf(stderr, "%s:%d: %s\n", ps->file, ps->line, what);
+    return -1;
+}
+
+/* A whole number in `t`, or -1. */
+static long long number(const char *t) {
+    if (!*t) return -1;
+    char *end;
+    long long v = strtoll(t, &end, 10);
+    return *end || v < 0 ? -1 : v;
+}
+
+/* "2-5,7" or "*" (every pid [0, N-1]) */
+static int parse_pids(Parser *ps, const char *t) {
+    ps->n_sect = 0;
+    if (strcmp(t, "*") == 0) {
+        for (int i = 0; i < ps->s->n; ++i) ps->sect[ps->n_sect++] = i;
+        return 0;
+    }
+    while (*t) {
+        char *end;
+        long a = strtol(t, &end, 10), b = a;
+        if (end == t) return fail(ps, "bad pid list");
+        if (*end == '-') {
+            t = end + 1;
+            b = strtol(t, &end, 10);
+            if (end == t) return fail(ps, "bad pid list");
+        }
+        if (a < 0 || b >= MAX_PEERS || a > b) return fail(ps, "pid out of range");
+        for (long i = a; i <= b && ps->n_sect < MAX_PEERS; ++i) ps->sect[ps->n_sect++] = (int)i;
+        if (*end == ',') end++;
+        else if (*end) return fail(ps, "bad pid list");
+        t = end;
+    }
+    return 0;
+}
+
+/* Append the finished statement to the programs it is for. */
+static int flush(Parser *ps) {
+    if (ps->cur.len == 0) return 0;
+    if (ps->line_pid < 0 && ps->n_sect == 0) return fail(ps, "instruction without a pid");
+    int n = ps->line_pid >= 0 ? 1 : ps->n_sect;
+    for (int k = 0; k < n; ++k) {
+        Program *p = &ps->s->prog[ps->line_pid >= 0 ? ps->line_pid : ps->sect[k]];
+        for (int i = 0; i < ps->cur.len; ++i) {
+            const ScriptOp *o = &ps->cur.ops[i];
+            program_add(p, o->op, o->arg, o->len);
+        }
+    }
+    ps->cur.len = 0;
+    return 0;
+}
+
+/* Split `line` into words and the tokens { } ; up to a '#'. */
+static int tokenize(char *line, char **tok, int max) {
+    int n = 0;
+    char *p = line;
+    while (*p && *p != '#' && n < max) {
+        if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { *p++ = '\0'; continue; }
+        if (*p == '{' || *p == '}' || *p == ';') {
+            static char single[3][2] = { "{", "}", ";" };
+            tok[n++] = single[*p == '{' ? 0 : *p == '}' ? 1 : 2];
+            *p++ = '\0';
+            continue;
+        }
+        tok[n++] = p;
+        while (*p && !strchr(" \t\r\n{};#", *p)) p++;
+    }
+    *p = '\0';
+    return n;
+}
+
+static int parse_line(Parser *ps, char *line) {
+    char *tok[256];
+    int n = tokenize(line, tok, 256);
+    int i = 0;
+    if (n == 0) return 0;
+    if (ps->depth == 0) {
+        if (strcmp(tok[0], "Pid") == 0) {
+            if (n != 2) return fail(ps, "expected: Pid <list>");
+            return parse_pids(ps, tok[1]);
+        }
+        long long pid = number(tok[0]);
+        if (pid >= MAX_PEERS) return fail(ps, "pid out of range");
+        ps->line_pid = (int)pid;
+        if (pid >= 0) i = 1;
+    }
+    while (i < n) {
+        const char *t = tok[i++];
+        long long arg = i < n ? number(tok[i]) : -1;
+        if (strcmp(t, ";") == 0) {
+            continue;
+        } else if (strcmp(t, "Lock") == 0) {
+            if (arg >= 0) i++;
+            program_add(&ps->cur, SOP_LOCK, arg >= 0 ? arg : 1, 0);
+        } else if (strcmp(t, "Wait") == 0) {
+            if (arg >= 0) i++;
+            program_add(&ps->cur, SOP_WAIT, arg >= 0 ? arg : 0, 0);
+        } else if (strcmp(t, "Leave") == 0) {
+            program_add(&ps->cur, SOP_LEAVE, 0, 0);
+        } else if (strcmp(t, "Repeat") == 0) {
+            if (arg < 0 || i + 1 >= n || strcmp(tok[i + 1], "{") != 0)
+                return fail(ps, "expected: Repeat <count> { ... }");
+            if (ps->depth == SCRIPT_DEPTH) return fail(ps, "Repeat blocks nested too deep");
+            i += 2;
+            ps->open[ps->depth++] = ps->cur.len;
+            program_add(&ps->cur, SOP_REPEAT, arg, 0);
+        } else if (strcmp(t, "}") == 0) {
+            if (ps->depth == 0) return fail(ps, "unmatched }");
+            int at = ps->open[--ps->depth];
+            ps->cur.ops[at].len = ps->cur.len - at - 1;
+        } else if (arg >= 0) {
+            i++; /* unknown instructions are skipped, like in the original format */
+        }
+        if (ps->depth == 0 && flush(ps) != 0) return -1;
+    }
+    return 0;
+}
+
+int script_load(const char *filename, Script *s) {
+    FILE *f = fopen(filename, "r");
+    if (!f) { perror(filename); return -1; }
+    Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.s = s;
+    ps.file = filename;
+    ps.sect = malloc(MAX_PEERS * sizeof(int));
+    char *line = NULL;
+    size_t len = 0;
+    int rc = 0;
+    if (getline(&line, &len, f) == -1 || sscanf(line, "%d", &s->n) != 1 || s->n <= 0 || s->n > MAX_PEERS) {
+        fprintf(stderr, "%s: bad N\n", filename);
+        rc = -1;
+    }
+    ps.line = 1;
+    while (rc == 0 && getline(&line, &len, f) != -1) {
+        ps.line++;
+        rc = parse_line(&ps, line);
+    }
+    if (rc == 0 && ps.depth > 0) rc = fail(&ps, "unclosed Repeat block");
+    free(line);
+    free(ps.cur.ops);
+    free(ps.sect);
+    fclose(f);
+    return rc;
+}
+
+void script_free(Script *s) {
+    for (int i = 0; i < MAX_PEERS; ++i) free(s->prog[i].ops);
+}
+
+static long long locks_in(const ScriptOp *ops, int len) {
+    long long k = 0;
+    for (int i = 0; i < len; ++i) {
+        if (ops[i].op == SOP_LOCK) {
+            k++;
+        } else if (ops[i].op == SOP_REPEAT) {
+            k += ops[i].arg * locks_in(ops + i + 1, ops[i].len);
+            i += ops[i].len;
+        }
+    }
+    return k;
+}
+
+long long program_locks(const Program *p) {
+    return locks_in(p->ops, p->len);
+}
+
+void cursor_init(Cursor *c, const Program *p) {
+    c->p = p;
+    c->pos = 0;
+    c->depth = 0;
+    c->frame[0].start = 0;
+    c->frame[0].end = p->len;
+    c->frame[0].left = 1;
+}
+
+const ScriptOp *cursor_next(Cursor *c) {
+    while (1) {
+        if (c->pos >= c->frame[c->depth].end) {
+            /* end of a body: run it again or leave the block */
+            if (c->depth == 0) return NULL;
+            if (--c->frame[c->depth].left > 0) {
+                c->pos = c->frame[c->depth].start;
+            } else {
+                c->pos = c->frame[c->depth].end;
+                c->depth--;
+            }
+            continue;
+        }
+        const ScriptOp *o = &c->p->ops[c->pos];
+        if (o->op != SOP_REPEAT) {
+            c->pos++;
+            return o;
+        }
+        if (o->arg == 0 || o->len == 0) {
+            c->pos += 1 + o->len;
+            continue;
+        }
+        c->depth++;
+        c->frame[c->depth].start = c->pos + 1;
+        c->frame[c->depth].end = c->pos + 1 + o->len;
+        c->frame[c->depth].left = o->arg;
+        c->pos++;
+    }
+}
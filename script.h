@@ -0,0 +1,66 @@
+/*
+* Input files of ./process: the instructions of every pid.
+*
+* The first line is N. Every other line holds instructions, separated by
+* ';', for the pid it starts with, or for the pids of the last "Pid" line:
+*
+*   0 Lock 1                        pid 0 holds the lock for 1 s
+*   1 Wait 0; Lock 2                pid 1 waits for a release of 0, then locks
+*   Pid 2-5,7                       the following lines are for pids 2..5 and 7
+*   Repeat 1000 { Lock 0; Wait 0 }  a block run 1000 times (blocks nest and
+*                                   may span lines)
+*   Leave
+*   Join                            marks a pid that run.pl starts later with
+*                                   --join (./process skips it)
+*
+* '#' starts a comment. A program is kept as written, with each Repeat
+* followed by its body, and run with a cursor, so a long run stays small in
+* memory and its Lock count is computed without expanding it.
+*/
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "lamport.h"
+
+#define SCRIPT_DEPTH 16 /* nesting of Repeat blocks */
+
+enum { SOP_LOCK, SOP_WAIT, SOP_LEAVE, SOP_REPEAT };
+
+typedef struct ScriptOp {
+    int op;
+    long long arg; /* Lock: seconds; Wait: pid; Repeat: count */
+    int len;       /* Repeat: number of ops in its body, which follows it */
+} ScriptOp;
+
+typedef struct Program {
+    ScriptOp *ops;
+    int len, cap;
+} Program;
+
+typedef struct Script {
+    int n;                    /* first line */
+    Program prog[MAX_PEERS];  /* per pid */
+} Script;
+
+/* Parse `filename` into `s` (zeroed by the caller); 0 on success, -1 with a
+   message on stderr. */
+int script_load(const char *filename, Script *s);
+void script_free(Script *s);
+void program_add(Program *p, int op, long long arg, int len);
+
+/* Lock instructions run by program `p`, repeats included. */
+long long program_locks(const Program *p);
+
+/* Position in a program. */
+typedef struct Cursor {
+    const Program *p;
+    int pos;
+    int depth;
+    struct { int start, end; long long left; } frame[SCRIPT_DEPTH + 1];
+} Cursor;
+
+void cursor_init(Cursor *c, const Program *p);
+/* Next Lock, Wait or Leave to run, or NULL at the end. */
+const ScriptOp *cursor_next(Cursor *c);
+
+#endif
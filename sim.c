@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lamport.h"
+#include "script.h"
+
+/* Discrete-event simulator: N nodes running the protocol of lamport.c in one
+   thread against a virtual clock (microseconds). Messages go through a simple
+   network model: each node sends on one egress link of --bandwidth-mbps
+   (messages serialized in send order), every message then travels for
+   --latency-us plus a uniform jitter of up to --jitter-us, and links stay
+   FIFO. Each node handles its incoming messages one at a time, --proc-us each.
+   Lock holders stay in the critical section for the duration of the Lock
+   instruction (or --cs-us in synthetic runs). */
+
+#define WIRE_OVERHEAD 66 /* Ethernet + IPv4 + TCP headers per message */
+
+static long long latency_us = 50;
+static long long jitter_us = 0;
+static double bandwidth_mbps = 0; /* 0 = unlimited */
+static long long proc_us = 0;
+static long long cs_us = 1000;
+static int synth_nodes = 0;
+static int synth_locks = 1;
+static unsigned long long seed = 1;
+
+static long long vnow = 0; /* virtual time, us */
+
+/* xorshift64*: deterministic for a given --seed */
+static unsigned long long rng_state;
+static unsigned long long rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+enum { ST_NEXT, ST_REQUESTED, ST_HOLDING, ST_WAITING, ST_DONE };
+
+/* Message queued at a node, waiting to be handled. */
+typedef struct Msg {
+    struct Msg *next;
+    char line[];
+} Msg;
+
+typedef struct SimNode {
+    Node node;
+    Program prog;         /* as in the input file of ./process, Lock in us */
+    Cursor cur;
+    const ScriptOp *op;   /* instruction being run, NULL once done */
+    int state;
+    int left;             /* executed Leave: messages to it are dropped */
+    int wait_seen;        /* releases of the awaited pid when the Wait began */
+    long long req_at;     /* virtual time of the outstanding REQ */
+    int dirty;            /* on the dirty list */
+    struct SimNode *next_dirty;
+    Msg *inbox_head, **inbox_tail;
+    int busy;             /* an EV_PROCESS is scheduled */
+    long long egress_free;
+} SimNode;
+
+static SimNode *sn;
+static int n_nodes;
+static SimNode *dirty_head = NULL;
+static long long *link_last; /* last arrival per (src, dst) link, keeps links FIFO */
+
+/* Events, ordered by (time, seq) so that runs are reproducible. */
+enum { EV_ARRIVE, EV_PROCESS, EV_EXIT };
+typedef struct Event {
+    long long t;
+    unsigned long long seq;
+    int type;
+    int node;
+    Msg *msg;
+} Event;
+static Event *heap;
+static size_t heap_len = 0, heap_cap = 0;
+static unsigned long long next_seq = 0;
+
+static int ev_less(const Event *a, const Event *b) {
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+static void ev_push(long long t, int type, int node, Msg *msg) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(Event));
+    }
+    size_t i = heap_len++;
+    Event e = { t, next_seq++, type, node, msg };
+    while (i > 0 && ev_less(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+static Event ev_pop(void) {
+    Event top = heap[0];
+    Event last = heap[--heap_len];
+    size_t i = 0;
+    while (1) {
+        size_t c = 2 * i + 1;
+        if (c >= heap_len) break;
+        if (c + 1 < heap_len && ev_less(&heap[c + 1], &heap[c])) c++;
+        if (!ev_less(&heap[c], &last)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (heap_len > 0) heap[i] = last;
+    return top;
+}
+
+/* Statistics */
+static long long messages = 0, bytes = 0, locks_done = 0;
+static long long *lat;
+static size_t lat_len = 0, lat_cap = 0;
+static int in_cs = 0, violations = 0;
+
+/* NodeOps */
+static long long sim_now_ms(void) {
+    return vnow / 1000;
+}
+static void sim_changed(Node *n) {
+    SimNode *s = n->ctx;
+    if (s->dirty) return;
+    s->dirty = 1;
+    s->next_dirty = dirty_head;
+    dirty_head = s;
+}
+static int sim_send(Node *n, int dst, const char *msg) {
+    if (dst < 0 || dst >= n_nodes || sn[dst].left) return -1;
+    SimNode *src = n->ctx;
+    size_t len = strlen(msg);
+    Msg *m = malloc(sizeof(Msg) + len + 1);
+    memcpy(m->line, msg, len + 1);
+    m->next = NULL;
+    long long t = vnow;
+    if (bandwidth_mbps > 0) {
+        if (src->egress_free > t) t = src->egress_free;
+        t += (long long)((len + WIRE_OVERHEAD) * 8 / bandwidth_mbps + 0.5);
+        src->egress_free = t;
+    }
+    t += latency_us;
+    if (jitter_us > 0) t += rng_next() % (unsigned long long)(jitter_us + 1);
+    long long *last = &link_last[(size_t)n->pid * n_nodes + dst];
+    if (t < *last) t = *last;
+    *last = t;
+    ev_push(t, EV_ARRIVE, dst, m);
+    messages++;
+    bytes += len + WIRE_OVERHEAD;
+    return 0;
+}
+static const NodeOps sim_ops = { sim_send, NULL, NULL, sim_changed, sim_now_ms };
+
+/* Advance node `s` as far as it can go at the current virtual time. */
+static void step(SimNode *s) {
+    Node *n = &s->node;
+    while (1) {
+        if (s->state == ST_REQUESTED) {
+            if (node_grant_state(n) <= 0) return;
+            node_enter(n);
+            if (in_cs++ > 0) violations++;
+            if (lat_len == lat_cap) {
+                lat_cap = lat_cap ? lat_cap * 2 : 1024;
+                lat = realloc(lat, lat_cap * sizeof(long long));
+            }
+            lat[lat_len++] = vnow - s->req_at;
+            s->state = ST_HOLDING;
+            ev_push(vnow + s->op->arg, EV_EXIT, n->pid, NULL);
+            return;
+        }
+        if (s->state == ST_HOLDING) return;
+        if (s->state == ST_WAITING) {
+            /* like ./process: wait for another release, or for the pid to be gone */
+            int other = (int)s->op->arg;
+            if (get_release_seen(n, other) <= s->wait_seen && sn[other].state != ST_DONE) return;
+            s->op = cursor_next(&s->cur);
+            s->state = ST_NEXT;
+        }
+        if (s->state == ST_DONE) return;
+        if (!s->op) {
+            s->state = ST_DONE;
+            /* nodes in Wait on us give up */
+            for (int i = 0; i < n_nodes; ++i) {
+                if (sn[i].state == ST_WAITING && sn[i].op->arg == n->pid) sim_changed(&sn[i].node);
+            }
+            return;
+        }
+        const ScriptOp *in = s->op;
+        if (in->op == SOP_LOCK) {
+            s->req_at = vnow;
+            node_request(n, 0);
+            s->state = ST_REQUESTED;
+        } else if (in->op == SOP_LEAVE) {
+            node_leave(n);
+            s->left = 1;
+            s->op = NULL;
+        } else {
+            int other = (int)in->arg;
+            if (other < 0 || other >= n_nodes || other == n->pid) {
+                s->op = cursor_next(&s->cur);
+                continue;
+            }
+            s->wait_seen = get_release_seen(n, other);
+            s->state = ST_WAITING;
+        }
+    }
+}
+
+static void step_dirty(void) {
+    while (dirty_head) {
+        SimNode *s = dirty_head;
+        dirty_head = s->next_dirty;
+        s->dirty = 0;
+        step(s);
+    }
+}
+
+/* Handle one event at its virtual time. */
+static void handle(Event *e) {
+    SimNode *s = &sn[e->node];
+    if (e->type == EV_ARRIVE) {
+        if (s->left) { free(e->msg); return; }
+        *s->inbox_tail = e->msg;
+        s->inbox_tail = &e->msg->next;
+        if (!s->busy) {
+            s->busy = 1;
+            ev_push(vnow + proc_us, EV_PROCESS, e->node, NULL);
+        }
+    } else if (e->type == EV_PROCESS) {
+        Msg *m = s->inbox_head;
+        s->inbox_head = m->next;
+        if (!s->inbox_head) s->inbox_tail = &s->inbox_head;
+        process_line(&s->node, m->line);
+        free(m);
+        if (s->inbox_head) ev_push(vnow + proc_us, EV_PROCESS, e->node, NULL);
+        else s->busy = 0;
+    } else {
+        in_cs--;
+        node_release(&s->node);
+        locks_done++;
+        s->op = cursor_next(&s->cur);
+        s->state = ST_NEXT;
+        sim_changed(&s->node);
+    }
+}
+
+/* Load the instructions of an input file of ./process ("Lock X" holds X seconds). */
+static int load_script(const char *filename) {
+    static Script script;
+    if (script_load(filename, &script) != 0) return -1;
+    n_nodes = script.n;
+    sn = calloc(n_nodes, sizeof(SimNode));
+    for (int i = 0; i < n_nodes; ++i) {
+        sn[i].prog = script.prog[i];
+        for (int k = 0; k < sn[i].prog.len; ++k)
+            if (sn[i].prog.ops[k].op == SOP_LOCK) sn[i].prog.ops[k].arg *= 1000000;
+    }
+    return 0;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <input_file>\n"
+            "       %s [options] --nodes <n> [--locks <k>] [--cs-us <us>]\n"
+            "  --latency-us <us>      one-way link latency (default 50)\n"
+            "  --jitter-us <us>       extra uniform delay in [0, us] (default 0)\n"
+            "  --bandwidth-mbps <m>   egress bandwidth per node, 0 = unlimited (default 0)\n"
+            "  --proc-us <us>         handling time of one message (default 0)\n"
+            "  --nodes <n>            synthetic run: n nodes, each taking the lock --locks times\n"
+            "  --locks <k>            locks per node in a synthetic run (default 1)\n"
+            "  --cs-us <us>           critical section length in a synthetic run (default 1000)\n"
+            "  --seed <s>             seed of the jitter (default 1)\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        {"latency-us", required_argument, NULL, 'L'},
+        {"jitter-us", required_argument, NULL, 'J'},
+        {"bandwidth-mbps", required_argument, NULL, 'B'},
+        {"proc-us", required_argument, NULL, 'P'},
+        {"nodes", required_argument, NULL, 'n'},
+        {"locks", required_argument, NULL, 'k'},
+        {"cs-us", required_argument, NULL, 'c'},
+        {"seed", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'L': latency_us = atoll(optarg); break;
+        case 'J': jitter_us = atoll(optarg); break;
+        case 'B': bandwidth_mbps = atof(optarg); break;
+        case 'P': proc_us = atoll(optarg); break;
+        case 'n': synth_nodes = atoi(optarg); break;
+        case 'k': synth_locks = atoi(optarg); break;
+        case 'c': cs_us = atoll(optarg); break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (latency_us < 0 || jitter_us < 0 || bandwidth_mbps < 0 || proc_us < 0 || cs_us < 0 ||
+        synth_locks < 0 || (synth_nodes == 0) == (argc - optind < 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+    rng_state = seed ? seed : 1;
+
+    if (synth_nodes) {
+        if (synth_nodes > MAX_PEERS) { fprintf(stderr, "at most %d nodes\n", MAX_PEERS); return 1; }
+        n_nodes = synth_nodes;
+        sn = calloc(n_nodes, sizeof(SimNode));
+        for (int i = 0; i < n_nodes; ++i) {
+            program_add(&sn[i].prog, SOP_REPEAT, synth_locks, 1);
+            program_add(&sn[i].prog, SOP_LOCK, cs_us, 0);
+        }
+    } else if (load_script(argv[optind]) != 0) {
+        return 1;
+    }
+
+    link_last = calloc((size_t)n_nodes * n_nodes, sizeof(long long));
+    for (int i = 0; i < n_nodes; ++i) {
+        node_init(&sn[i].node, i, &sim_ops, &sn[i]);
+        sn[i].node.quiet = 1;
+        sn[i].inbox_tail = &sn[i].inbox_head;
+        cursor_init(&sn[i].cur, &sn[i].prog);
+        sn[i].op = cursor_next(&sn[i].cur);
+        for (int j = 0; j < n_nodes; ++j) add_member(&sn[i].node, j);
+    }
+
+    struct timespec w0, w1;
+    clock_gettime(CLOCK_MONOTONIC, &w0);
+    for (int i = 0; i < n_nodes; ++i) sim_changed(&sn[i].node);
+    step_dirty();
+    while (heap_len > 0) {
+        Event e = ev_pop();
+        vnow = e.t;
+        handle(&e);
+        step_dirty();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w1);
+    double wall = (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9;
+
+    int stuck = 0;
+    for (int i = 0; i < n_nodes; ++i) stuck += sn[i].state != ST_DONE;
+
+    qsort(lat, lat_len, sizeof(long long), cmp_ll);
+    double sum = 0;
+    for (size_t i = 0; i < lat_len; ++i) sum += lat[i];
+    double vsec = vnow / 1e6;
+    printf("algorithm      lamport\n");
+    printf("nodes          %d\n", n_nodes);
+    printf("locks          %lld\n", locks_done);
+    printf("messages       %lld (%.1f per lock, %lld bytes on the wire)\n", messages,
+           locks_done ? (double)messages / locks_done : 0.0, bytes);
+    printf("virtual time   %.6f s\n", vsec);
+    printf("throughput     %.2f locks/s\n", vsec > 0 ? locks_done / vsec : 0.0);
+    if (lat_len > 0) {
+        printf("latency (us)   mean %.1f  p50 %lld  p99 %lld  max %lld\n", sum / lat_len,
+               lat[lat_len / 2], lat[(size_t)(lat_len * 0.99)], lat[lat_len - 1]);
+    }
+    printf("wall time      %.3f s\n", wall);
+    if (violations) printf("SAFETY VIOLATION: %d overlapping critical sections\n", violations);
+    if (stuck) printf("%d nodes did not finish their instructions\n", stuck);
+    return violations || stuck ? 1 : 0;
+}
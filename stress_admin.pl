@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use IO::Select;
+use IO::Socket::UNIX;
+use POSIX qw(WNOHANG);
+use Time::HiRes qw(sleep time);
+
+# Usage: ./stress_admin.pl [--pids 16] [--locks 4000] [--timeout 60] [--base-port 40000]
+# Dumps the state on the admin socket in a loop while --pids participants in
+# one process (--bench --vnodes) contend for the lock --locks times each. A
+# dump takes every lock of a node, so this catches lock order inversions
+# between the dump and the grant path: the run must finish within --timeout
+# seconds with every pid reporting. Exit 0 on success.
+
+my $pids = 16;
+my $locks = 4000;
+my $timeout = 60;
+my $base_port = 40000;
+GetOptions("pids=i" => \$pids, "locks=i" => \$locks, "timeout=i" => \$timeout, "base-port=i" => \$base_port)
+	or die "Usage: $0 [--pids n] [--locks k] [--timeout s] [--base-port port]\n";
+
+my $dir = tempdir("stress_admin.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+open(my $fh, '>', "$dir/script") or die "$dir/script: $!";
+print $fh "$pids\nPid *\nRepeat $locks { Lock 0 }\n";
+close($fh);
+
+my $pid = fork();
+die "Fork failed: $!" unless defined $pid;
+if ($pid == 0) {
+	open(STDOUT, '>', "$dir/out") or die "$dir/out: $!";
+	exec("./process", "--bench", "--vnodes", $pids, "--base-port", $base_port, "--admin", "$dir/S", 0, "$dir/script")
+		or die "Exec failed: $!";
+}
+
+my ($dumps, $status) = (0, undef);
+my $deadline = time() + $timeout;
+DUMP: while (time() < $deadline) {
+	if (waitpid($pid, WNOHANG) == $pid) { $status = $?; last; }
+	my $s = IO::Socket::UNIX->new(Peer => "$dir/S", Type => SOCK_STREAM);
+	if (!$s) { sleep(0.01); next; }
+	# a dump blocked by a deadlock never answers
+	my $sel = IO::Select->new($s);
+	my $text = "";
+	while (1) {
+		last DUMP unless $sel->can_read($deadline - time());
+		last unless sysread($s, $text, 65536, length($text));
+	}
+	$dumps++ if $text ne "";
+	close($s);
+}
+if (!defined $status) {
+	kill 'KILL', $pid;
+	waitpid($pid, 0);
+	die "stress_admin: no progress after $timeout s ($dumps dumps): deadlock?\n";
+}
+open($fh, '<', "$dir/out") or die "$dir/out: $!";
+my $reports = grep { /^\[proc \d+\] bench $locks / } <$fh>;
+close($fh);
+die "stress_admin: process exited with status $status\n" if $status;
+die "stress_admin: $reports of $pids pids finished their locks\n" if $reports != $pids;
+print "stress_admin: ok ($pids pids x $locks locks, $dumps dumps)\n";
+exit 0;
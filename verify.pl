@@ -0,0 +1,104 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Long;
+use Time::HiRes qw(sleep);
+use FindBin;
+use lib $FindBin::Bin;
+use LockScript qw(expand);
+
+# Usage: ./verify.pl [--follow] [--watch <pid,pid,...>] <testfile> [log.txt]
+# Checks a log against the test file event by event: at most one process in
+# the critical section, non-decreasing timestamps, releases only by the
+# holder, no more locks than Lock instructions, and the Wait constraints
+# (run.pl's checks). Each event costs O(1): the Wait instructions before
+# each Lock are resolved up front, and every one is checked once, at the
+# take that follows it.
+#
+# With --follow it tails the log while the run writes it and stops at the
+# first violation (exit 1), or once every Lock has been released or the
+# processes of --watch have all exited (exit 0, after reading what is left).
+
+my $follow = 0;
+my $watch = "";
+GetOptions("follow" => \$follow, "watch=s" => \$watch)
+	or die "Usage: $0 [--follow] [--watch pids] <testfile> [log.txt]\n";
+my $test = shift or die "Usage: $0 [--follow] [--watch pids] <testfile> [log.txt]\n";
+my $log = shift // "log.txt";
+my @watched = grep { $_ ne "" } split /,/, $watch;
+
+# For the k-th Lock of each pid: the Wait constraints it must satisfy, as
+# [other pid, locks that pid must have taken]
+my (undef, @instructions) = expand($test);
+my (%waits_before, %pending, %waited, %locks_of);
+my $total_locks = 0;
+for my $line (@instructions) {
+	if ($line =~ /(\d+) Wait (\d+)/) {
+		push @{$pending{$1}}, [$2, ++$waited{$1}{$2}];
+	} elsif ($line =~ /(\d+) Lock/) {
+		$waits_before{$1}[$locks_of{$1}++] = delete $pending{$1} // [];
+		$total_locks++;
+	}
+}
+
+my ($last_time, $holder, $released) = (0, undef, 0);
+my %taken; # locks taken per pid
+
+sub violation {
+	print STDERR "verify: $_[0]\n";
+	exit 1;
+}
+
+sub check {
+	chomp(my $l = shift);
+	if ($l =~ /^\[Process (\d+)\] \[Time (\d+)\] Lock taken$/) {
+		violation("timestamps are not non-decreasing at: $l") if $2 < $last_time;
+		$last_time = $2;
+		violation("process $1 took the lock while process $holder holds it") if defined $holder;
+		$holder = $1;
+		my $k = $taken{$1}++;
+		violation("process $1 took too many locks (only " . ($locks_of{$1} // 0) . " Lock instructions)")
+			if $k >= ($locks_of{$1} // 0);
+		for my $w (@{$waits_before{$1}[$k]}) {
+			my ($other, $need) = @$w;
+			violation("process $1 did not wait enough for process $other (" . ($taken{$other} // 0) .
+				" locks taken instead of $need)") if ($taken{$other} // 0) < $need;
+		}
+	} elsif ($l =~ /^\[Process (\d+)\] \[Time (\d+)\] Lock released$/) {
+		violation("timestamps are not non-decreasing at: $l") if $2 < $last_time;
+		$last_time = $2;
+		violation("process $1 released the lock without holding it") if !defined $holder || $holder != $1;
+		$holder = undef;
+		$released++;
+	} else {
+		violation("unrecognized log line: $l");
+	}
+}
+
+# Wait for the run to create the log
+my $fh;
+until (open($fh, '<', $log)) {
+	die "$log: $!\n" unless $follow;
+	exit 0 if @watched && !grep { kill 0, $_ } @watched;
+	sleep(0.02);
+}
+my ($partial, $done) = ("", 0);
+while (1) {
+	my $got = 0;
+	while (defined(my $chunk = <$fh>)) {
+		$got = 1;
+		$partial .= $chunk;
+		next unless $partial =~ /\n$/;
+		check($partial);
+		$partial = "";
+	}
+	last if !$follow || $done || $released == $total_locks;
+	# once the processes are gone, one more pass reads their last lines
+	$done = 1 if !$got && @watched && !grep { kill 0, $_ } @watched;
+	sleep(0.02) unless $got || $done;
+	seek($fh, 0, 1); # clear EOF
+}
+check($partial) if $partial ne "";
+close($fh);
+print "verify: ok ($released of $total_locks locks released)\n";
+exit 0;